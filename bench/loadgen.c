@@ -0,0 +1,322 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ *
+ * Open-loop load generator for shm_ring.h channels.
+ *   cc -O2 -I.. -o loadgen loadgen.c -lm
+ *   loadgen [-g lo:hi:factor | -r r1,r2,...] [-d seconds] [-s fixed:N|uniform:A:B|exp:MEAN|bimodal:A:B:P]
+ *
+ * Requests are scheduled at fixed intervals (1 / rate) independently of when earlier requests complete.
+ * Each latency is measured from the request's *intended* send time, not from when the generator actually
+ * managed to send it, so time spent queued behind a slow consumer (or behind a full submission ring) is
+ * charged to the requests that waited - the coordinated-omission correction. A closed-loop ping-pong
+ * would instead silently stop sending while the consumer stalls and report only the fast samples.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "../shm_ring.h"
+
+#define RING_NAME "/shm_loadgen"
+#define SQ_ENTRIES 1024
+#define BUF_COUNT 1024
+#define MAX_RATES 64
+#define HIST_SUB_BITS 6
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS) * (1 << HIST_SUB_BITS) + (2 << HIST_SUB_BITS))
+#define OP_ECHO 1
+#define OP_QUIT 2
+
+typedef enum _size_dist {
+    SizeFixed = 1, SizeUniform = 2, SizeExp = 3, SizeBimodal = 4
+} size_dist_t;
+
+typedef struct _size_spec {
+    size_dist_t dist;
+    double a, b, p;
+    size_t max;
+} size_spec_t;
+
+typedef struct _histogram {
+    uint64_t count[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} histogram_t;
+
+static unsigned
+hist_index(uint64_t v)
+{
+    /* log-linear buckets: exact below 2^(SUB+1), then 2^SUB sub-buckets per power of two (~1.5% error) */
+    unsigned msb, shift;
+    if (v < (2u << HIST_SUB_BITS))
+        return (unsigned) v;
+    msb = 63 - (unsigned) __builtin_clzll(v);
+    shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * (1u << HIST_SUB_BITS) + (unsigned) ((v >> shift) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+static uint64_t
+hist_value(unsigned idx)
+{
+    unsigned shift;
+    if (idx < (2u << HIST_SUB_BITS))
+        return idx;
+    shift = idx / (1u << HIST_SUB_BITS) - 1;
+    return ((uint64_t) (1u << HIST_SUB_BITS) + idx % (1u << HIST_SUB_BITS)) << shift;
+}
+
+static void
+hist_record(histogram_t *h, uint64_t v)
+{
+    ++h->count[hist_index(v)];
+    ++h->total;
+    if (v > h->max)
+        h->max = v;
+}
+
+static uint64_t
+hist_percentile(const histogram_t *h, double p)
+{
+    uint64_t want = (uint64_t) ceil(p / 100.0 * (double) h->total), seen = 0;
+    unsigned i;
+    if (want == 0)
+        want = 1;
+    for (i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->count[i];
+        if (seen >= want)
+            return hist_value(i);
+    }
+    return h->max;
+}
+
+static uint64_t
+xorshift(uint64_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static size_t
+draw_size(const size_spec_t *spec, uint64_t *rng)
+{
+    double u = (double) (xorshift(rng) >> 11) / 9007199254740992.0, v;
+    switch (spec->dist) {
+        case SizeUniform:
+            v = spec->a + u * (spec->b - spec->a);
+            break;
+        case SizeExp:
+            v = -spec->a * log(1.0 - u);
+            break;
+        case SizeBimodal:
+            v = u < spec->p ? spec->a : spec->b;
+            break;
+        default:
+            v = spec->a;
+    }
+    if (v < 1)
+        v = 1;
+    return v > (double) spec->max ? spec->max : (size_t) v;
+}
+
+static int
+parse_size(size_spec_t *spec, const char *arg)
+{
+    spec->a = spec->b = spec->p = 0;
+    if (sscanf(arg, "fixed:%lf", &spec->a) == 1)
+        spec->dist = SizeFixed;
+    else if (sscanf(arg, "uniform:%lf:%lf", &spec->a, &spec->b) == 2)
+        spec->dist = SizeUniform;
+    else if (sscanf(arg, "exp:%lf", &spec->a) == 1)
+        spec->dist = SizeExp;
+    else if (sscanf(arg, "bimodal:%lf:%lf:%lf", &spec->a, &spec->b, &spec->p) == 3)
+        spec->dist = SizeBimodal;
+    else
+        return 1;
+    spec->max = (size_t) (spec->b > spec->a ? spec->b : spec->a);
+    if (spec->dist == SizeExp)
+        spec->max = (size_t) (spec->a * 16);
+    return spec->max == 0;
+}
+
+static void
+run_server(void)
+{
+    /* consumer: copy each payload out (what a real consumer would do) and complete it */
+    ring_t ring;
+    char *sink;
+    if (open_ring(&ring, RING_NAME) != 0)
+        _exit(1);
+    sink = (char *) malloc(ring.hdr->buf_size);
+    for (;;) {
+        unsigned n, i;
+        ring_wait_sqes(&ring, 0);
+        n = ring_peek_sqes(&ring, NULL);
+        for (i = 0; i < n; ++i) {
+            ring_sqe_t *sqe = ring_sqe_at(&ring, i);
+            if (sqe->opcode == OP_QUIT)
+                _exit(0);
+            memcpy(sink, ring_buffer(&ring, sqe->buf), sqe->len);
+            ring_post_cqe(&ring, sqe->user_data, (int32_t) sqe->len, 0);
+        }
+        ring_consume_sqes(&ring, n);
+    }
+}
+
+static void
+reap(ring_t *ring, histogram_t *h, uint64_t start, uint64_t interval, uint64_t warm, uint64_t *done)
+{
+    ring_cqe_t *cqe;
+    uint64_t now = 0;
+    while ((cqe = ring_peek_cqe(ring)) != NULL) {
+        uint64_t seq = cqe->user_data;
+        if (now == 0)
+            now = monotonic_ns();
+        if (seq >= warm)
+            hist_record(h, now - (start + seq * interval));
+        ring_cqe_seen(ring, 1);
+        ++*done;
+    }
+}
+
+static void
+run_rate(ring_t *ring, double rate, double seconds, const size_spec_t *spec, char *payload,
+         histogram_t *h, double *achieved)
+{
+    uint64_t interval = (uint64_t) (1e9 / rate);
+    uint64_t total = (uint64_t) (rate * seconds), warm = total / 10, sent = 0, done = 0, rng = 88172645463325252ull;
+    uint64_t start, end;
+    if (interval == 0)
+        interval = 1;
+    memset(h, 0, sizeof(*h));
+    start = monotonic_ns() + 1000000;
+    while (done < total) {
+        uint64_t now = monotonic_ns();
+        reap(ring, h, start, interval, warm, &done);
+        /* send everything whose intended time has passed; never skip a slot, only run late */
+        while (sent < total && start + sent * interval <= now && sent - done < BUF_COUNT) {
+            ring_sqe_t *sqe = ring_get_sqe(ring);
+            size_t len;
+            if (sqe == NULL)
+                break;
+            len = draw_size(spec, &rng);
+            sqe->opcode = OP_ECHO;
+            sqe->user_data = sent;
+            sqe->buf = (uint32_t) (sent % BUF_COUNT);
+            sqe->len = (uint32_t) len;
+            memcpy(ring_buffer(ring, sqe->buf), payload, len);
+            ++sent;
+        }
+        ring_submit(ring);
+        if (sent < total && start + sent * interval > now && done == sent) {
+            /* idle until the next intended send time */
+            while (monotonic_ns() < start + sent * interval)
+                cpu_relax();
+        }
+    }
+    end = monotonic_ns();
+    *achieved = (double) total / ((double) (end - start) / 1e9);
+}
+
+int
+main(int argc, char **argv)
+{
+    double rates[MAX_RATES], seconds = 1.0, lo = 10000, hi = 2000000, factor = 2, base_p99 = 0;
+    size_spec_t spec = {SizeFixed, 64, 0, 0, 64};
+    unsigned nrates = 0, i;
+    int opt, cliff = -1;
+    ring_t ring;
+    ring_sqe_t *quit;
+    pid_t server;
+    char *payload;
+    histogram_t *h = (histogram_t *) malloc(sizeof(histogram_t));
+    while ((opt = getopt(argc, argv, "g:r:d:s:")) != -1) {
+        switch (opt) {
+            case 'g':
+                if (sscanf(optarg, "%lf:%lf:%lf", &lo, &hi, &factor) != 3 || lo <= 0 || factor <= 1) {
+                    fprintf(stderr, "bad sweep %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'r': {
+                char *tok = strtok(optarg, ","), *end;
+                for (; tok && nrates < MAX_RATES; tok = strtok(NULL, ",")) {
+                    /* run_rate() divides by the rate */
+                    rates[nrates] = strtod(tok, &end);
+                    if (end == tok || *end != '\0' || !(rates[nrates] > 0)) {
+                        fprintf(stderr, "bad rate %s\n", tok);
+                        return 2;
+                    }
+                    ++nrates;
+                }
+                break;
+            }
+            case 'd':
+                seconds = atof(optarg);
+                break;
+            case 's':
+                if (parse_size(&spec, optarg) != 0) {
+                    fprintf(stderr, "bad size distribution %s\n", optarg);
+                    return 2;
+                }
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-g lo:hi:factor | -r r1,r2,...] [-d seconds] "
+                                "[-s fixed:N|uniform:A:B|exp:MEAN|bimodal:A:B:P]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (nrates == 0)
+        for (; lo <= hi && nrates < MAX_RATES; lo *= factor)
+            rates[nrates++] = lo;
+    if (nrates == 0) {
+        fprintf(stderr, "empty rate list\n");
+        return 2;
+    }
+    close_ring(RING_NAME);
+    if (create_ring(&ring, RING_NAME, SQ_ENTRIES, SQ_ENTRIES * 2, BUF_COUNT, spec.max) != 0) {
+        perror("create_ring");
+        return 1;
+    }
+    payload = (char *) malloc(spec.max);
+    memset(payload, 0xa5, spec.max);
+    server = fork();
+    if (server == 0)
+        run_server();
+    printf("%12s %12s %10s %10s %10s %10s %10s\n", "target/s", "achieved/s", "p50(ns)", "p90(ns)", "p99(ns)",
+           "p99.9(ns)", "max(ns)");
+    for (i = 0; i < nrates; ++i) {
+        double achieved;
+        uint64_t p99;
+        run_rate(&ring, rates[i], seconds, &spec, payload, h, &achieved);
+        p99 = hist_percentile(h, 99);
+        printf("%12.0f %12.0f %10llu %10llu %10llu %10llu %10llu\n", rates[i], achieved,
+               (unsigned long long) hist_percentile(h, 50), (unsigned long long) hist_percentile(h, 90),
+               (unsigned long long) p99, (unsigned long long) hist_percentile(h, 99.9),
+               (unsigned long long) h->max);
+        fflush(stdout);
+        if (i == 0)
+            base_p99 = (double) p99;
+        if (cliff < 0 && i > 0 && ((double) p99 > 10 * base_p99 || achieved < 0.95 * rates[i]))
+            cliff = (int) i;
+    }
+    if (cliff >= 0)
+        printf("# p99 cliff: %.0f/s sustains, %.0f/s does not\n", rates[cliff - 1], rates[cliff]);
+    else
+        printf("# no p99 cliff up to %.0f/s\n", rates[nrates - 1]);
+    /* every request of the last rate has completed, so the submission ring has room */
+    quit = ring_get_sqe(&ring);
+    quit->opcode = OP_QUIT;
+    ring_submit(&ring);
+    waitpid(server, NULL, 0);
+    detach_ring(&ring);
+    close_ring(RING_NAME);
+    free(payload);
+    free(h);
+    return 0;
+}
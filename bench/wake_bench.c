@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ *
+ * Handoff latency and CPU cost of cross-process wake-up primitives.
+ *   cc -O2 -I.. -o wake_bench wake_bench.c -pthread
+ *   wake_bench [-n round trips] [-t seconds per cell]
+ *
+ * Two processes ping-pong a token through each primitive; one round trip is two handoffs. For every
+ * primitive the run is repeated with both processes pinned to the same core (SMT siblings, or the same
+ * logical CPU when there are none), to two cores sharing an L3, and to two sockets, as found in
+ * /sys/devices/system/cpu. Placements the machine does not have are reported as "n/a".
+ * The CPU column is the user+system time both processes burned per handoff; for a blocking primitive it is
+ * the cost of the sleep/wake path, for spinning it is the whole wait.
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <semaphore.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include "../shm_wait.h"
+
+#define MAX_SAMPLES 200000
+#define NAMED_SEM0 "/wake_bench.0"
+#define NAMED_SEM1 "/wake_bench.1"
+
+typedef enum _primitive {
+    PrimNamedSem = 0, PrimUnnamedSem, PrimFutex, PrimEventfd, PrimPipe, PrimSpin, PrimAdaptive, PrimUmwait, PrimCount
+} primitive_t;
+
+static const char *prim_names[PrimCount] = {
+    "named-sem", "pshared-sem", "futex", "eventfd", "pipe", "spin", "adaptive", "umwait"
+};
+
+typedef struct _shared_state {
+    sem_t usem[2];
+    volatile uint32_t seq[2];
+    volatile uint32_t waiters[2];
+    volatile uint64_t child_cpu_ns;
+    volatile int stop;
+} shared_state_t;
+
+typedef struct _channel {
+    primitive_t prim;
+    shared_state_t *st;
+    sem_t *nsem[2];
+    int efd[2];
+    int pfd[2][2];
+    uint32_t seen[2];
+} channel_t;
+
+static int
+channel_setup(channel_t *c, primitive_t prim, shared_state_t *st)
+{
+    memset(c, 0, sizeof(*c));
+    c->prim = prim;
+    c->st = st;
+    memset(st, 0, sizeof(*st));
+    switch (prim) {
+        case PrimNamedSem:
+            sem_unlink(NAMED_SEM0);
+            sem_unlink(NAMED_SEM1);
+            c->nsem[0] = sem_open(NAMED_SEM0, O_CREAT | O_RDWR, 0600, 0);
+            c->nsem[1] = sem_open(NAMED_SEM1, O_CREAT | O_RDWR, 0600, 0);
+            return c->nsem[0] == SEM_FAILED || c->nsem[1] == SEM_FAILED;
+        case PrimUnnamedSem:
+#ifdef __APPLE__
+            return 1;
+#else
+            return sem_init(&st->usem[0], 1, 0) != 0 || sem_init(&st->usem[1], 1, 0) != 0;
+#endif
+        case PrimFutex:
+#ifdef __linux__
+            return 0;
+#else
+            return 1;
+#endif
+        case PrimEventfd:
+#ifdef __linux__
+            c->efd[0] = eventfd(0, 0);
+            c->efd[1] = eventfd(0, 0);
+            return c->efd[0] < 0 || c->efd[1] < 0;
+#else
+            return 1;
+#endif
+        case PrimPipe:
+            return pipe(c->pfd[0]) != 0 || pipe(c->pfd[1]) != 0;
+        default:
+            return 0;
+    }
+}
+
+static void
+channel_teardown(channel_t *c)
+{
+    switch (c->prim) {
+        case PrimNamedSem:
+            sem_close(c->nsem[0]);
+            sem_close(c->nsem[1]);
+            sem_unlink(NAMED_SEM0);
+            sem_unlink(NAMED_SEM1);
+            break;
+        case PrimUnnamedSem:
+#ifndef __APPLE__
+            sem_destroy(&c->st->usem[0]);
+            sem_destroy(&c->st->usem[1]);
+#endif
+            break;
+        case PrimEventfd:
+            close(c->efd[0]);
+            close(c->efd[1]);
+            break;
+        case PrimPipe:
+            close(c->pfd[0][0]);
+            close(c->pfd[0][1]);
+            close(c->pfd[1][0]);
+            close(c->pfd[1][1]);
+            break;
+        default:
+            break;
+    }
+}
+
+static void
+channel_signal(channel_t *c, int dir)
+{
+    uint64_t one = 1;
+    char b = 1;
+    switch (c->prim) {
+        case PrimNamedSem:
+            sem_post(c->nsem[dir]);
+            break;
+        case PrimUnnamedSem:
+            sem_post(&c->st->usem[dir]);
+            break;
+        case PrimFutex:
+            __atomic_add_fetch(&c->st->seq[dir], 1, __ATOMIC_RELEASE);
+            futex_wake_word(&c->st->seq[dir], 1);
+            break;
+        case PrimEventfd:
+            if (write(c->efd[dir], &one, sizeof(one)) != sizeof(one))
+                abort();
+            break;
+        case PrimPipe:
+            if (write(c->pfd[dir][1], &b, 1) != 1)
+                abort();
+            break;
+        case PrimSpin:
+            __atomic_add_fetch(&c->st->seq[dir], 1, __ATOMIC_RELEASE);
+            break;
+        case PrimAdaptive:
+        case PrimUmwait:
+            __atomic_add_fetch(&c->st->seq[dir], 1, __ATOMIC_RELEASE);
+            notify_change(&c->st->seq[dir], &c->st->waiters[dir]);
+            break;
+        default:
+            break;
+    }
+}
+
+static void
+channel_wait(channel_t *c, int dir)
+{
+    static const wait_policy_t adaptive = {WaitAdaptive, WAIT_DEFAULT_SPINS};
+    static const wait_policy_t umwait = {WaitUmwait, WAIT_UMWAIT_ROUNDS};
+    uint64_t v;
+    char b;
+    switch (c->prim) {
+        case PrimNamedSem:
+            while (sem_wait(c->nsem[dir]) != 0 && errno == EINTR);
+            break;
+        case PrimUnnamedSem:
+            while (sem_wait(&c->st->usem[dir]) != 0 && errno == EINTR);
+            break;
+        case PrimFutex:
+            while (__atomic_load_n(&c->st->seq[dir], __ATOMIC_ACQUIRE) == c->seen[dir])
+                futex_wait_word(&c->st->seq[dir], c->seen[dir], 0);
+            ++c->seen[dir];
+            break;
+        case PrimEventfd:
+            if (read(c->efd[dir], &v, sizeof(v)) != sizeof(v))
+                abort();
+            break;
+        case PrimPipe:
+            if (read(c->pfd[dir][0], &b, 1) != 1)
+                abort();
+            break;
+        case PrimSpin:
+            while (__atomic_load_n(&c->st->seq[dir], __ATOMIC_ACQUIRE) == c->seen[dir])
+                cpu_relax();
+            ++c->seen[dir];
+            break;
+        case PrimAdaptive:
+            if (__atomic_load_n(&c->st->seq[dir], __ATOMIC_ACQUIRE) == c->seen[dir])
+                wait_for_change(&c->st->seq[dir], c->seen[dir], &c->st->waiters[dir], &adaptive, 0);
+            ++c->seen[dir];
+            break;
+        case PrimUmwait:
+            if (__atomic_load_n(&c->st->seq[dir], __ATOMIC_ACQUIRE) == c->seen[dir])
+                wait_for_change(&c->st->seq[dir], c->seen[dir], &c->st->waiters[dir], &umwait, 0);
+            ++c->seen[dir];
+            break;
+        default:
+            break;
+    }
+}
+
+static uint64_t
+cpu_ns(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ((uint64_t) ru.ru_utime.tv_sec + (uint64_t) ru.ru_stime.tv_sec) * 1000000000ull
+           + ((uint64_t) ru.ru_utime.tv_usec + (uint64_t) ru.ru_stime.tv_usec) * 1000ull;
+}
+
+static int
+read_int(const char *fmt, int cpu)
+{
+    char path[256];
+    FILE *f;
+    int v = -1;
+    snprintf(path, sizeof(path), fmt, cpu);
+    f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    if (fscanf(f, "%d", &v) != 1)
+        v = -1;
+    fclose(f);
+    return v;
+}
+
+static void
+find_placements(int pairs[3][2])
+{
+    /* [0] same core, [1] same L3 different core, [2] different socket; -1 when absent */
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int pkg0 = read_int("/sys/devices/system/cpu/cpu%d/topology/physical_package_id", 0);
+    int core0 = read_int("/sys/devices/system/cpu/cpu%d/topology/core_id", 0);
+    int l30 = read_int("/sys/devices/system/cpu/cpu%d/cache/index3/id", 0);
+    int cpu;
+    pairs[0][0] = 0;
+    pairs[0][1] = 0;
+    pairs[1][0] = pairs[1][1] = pairs[2][0] = pairs[2][1] = -1;
+    for (cpu = 1; cpu < ncpu; ++cpu) {
+        int pkg = read_int("/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        int core = read_int("/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+        int l3 = read_int("/sys/devices/system/cpu/cpu%d/cache/index3/id", cpu);
+        if (pkg == pkg0 && core == core0 && pairs[0][1] == 0)
+            pairs[0][1] = cpu;
+        else if (pkg == pkg0 && core != core0 && l3 == l30 && l3 >= 0 && pairs[1][0] < 0) {
+            pairs[1][0] = 0;
+            pairs[1][1] = cpu;
+        } else if (pkg != pkg0 && pkg >= 0 && pairs[2][0] < 0) {
+            pairs[2][0] = 0;
+            pairs[2][1] = cpu;
+        }
+    }
+}
+
+static void
+pin(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+#else
+    (void) cpu;
+#endif
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static int
+run_cell(primitive_t prim, const int pair[2], long iters, double budget, shared_state_t *st, uint64_t *samples,
+         double out[3])
+{
+    /* out: p50 handoff ns, p99 handoff ns, CPU ns per handoff */
+    channel_t c;
+    pid_t child;
+    long i, n = 0;
+    uint64_t cpu0, t0, deadline;
+    if (channel_setup(&c, prim, st) != 0)
+        return 1;
+    child = fork();
+    if (child == 0) {
+        uint64_t c0;
+        pin(pair[1]);
+        c0 = cpu_ns();
+        for (;;) {
+            channel_wait(&c, 0);
+            if (st->stop)
+                break;
+            channel_signal(&c, 1);
+        }
+        st->child_cpu_ns = cpu_ns() - c0;
+        _exit(0);
+    }
+    pin(pair[0]);
+    cpu0 = cpu_ns();
+    t0 = monotonic_ns();
+    deadline = t0 + (uint64_t) (budget * 1e9);
+    for (i = 0; i < iters; ++i) {
+        uint64_t s = monotonic_ns();
+        if (s > deadline)
+            break;
+        channel_signal(&c, 0);
+        channel_wait(&c, 1);
+        samples[n++] = (monotonic_ns() - s) / 2;
+    }
+    st->stop = 1;
+    channel_signal(&c, 0);
+    waitpid(child, NULL, 0);
+    channel_teardown(&c);
+    if (n == 0)
+        return 1;
+    qsort(samples, (size_t) n, sizeof(uint64_t), cmp_u64);
+    out[0] = (double) samples[n / 2];
+    out[1] = (double) samples[(n * 99) / 100];
+    out[2] = (double) (cpu_ns() - cpu0 + st->child_cpu_ns) / (double) (2 * n);
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    static const char *placement_names[3] = {"same-core", "same-l3", "cross-socket"};
+    int pairs[3][2], opt, p, k;
+    long iters = 100000;
+    double budget = 2.0, out[3];
+    shared_state_t *st;
+    uint64_t *samples;
+    while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+        if (opt == 'n')
+            iters = atol(optarg);
+        else if (opt == 't')
+            budget = atof(optarg);
+        else {
+            fprintf(stderr, "usage: %s [-n round trips] [-t seconds per cell]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (iters > MAX_SAMPLES)
+        iters = MAX_SAMPLES;
+    st = (shared_state_t *) mmap(NULL, sizeof(*st), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    samples = (uint64_t *) malloc(sizeof(uint64_t) * MAX_SAMPLES);
+    if (st == MAP_FAILED || samples == NULL)
+        return 1;
+    find_placements(pairs);
+    printf("%-12s %-13s %8s %12s %12s %12s\n", "primitive", "placement", "cpus", "p50(ns)", "p99(ns)",
+           "cpu(ns)/op");
+    for (p = 0; p < PrimCount; ++p) {
+        for (k = 0; k < 3; ++k) {
+            char cpus[32];
+            if (pairs[k][0] < 0) {
+                printf("%-12s %-13s %8s %12s\n", prim_names[p], placement_names[k], "-", "n/a");
+                continue;
+            }
+            snprintf(cpus, sizeof(cpus), "%d,%d", pairs[k][0], pairs[k][1]);
+            if (run_cell((primitive_t) p, pairs[k], iters, budget, st, samples, out) != 0)
+                printf("%-12s %-13s %8s %12s\n", prim_names[p], placement_names[k], cpus, "unsupported");
+            else
+                printf("%-12s %-13s %8s %12.0f %12.0f %12.0f\n", prim_names[p], placement_names[k], cpus,
+                       out[0], out[1], out[2]);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
@@ -18,6 +18,13 @@
 #include <stdlib.h>
 #include <memory.h>
 #include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include "shm_segment.h"
+#include "shm_crc32c.h"
+#include "shm_lz.h"
+#include "shm_trace.h"
 /***************************************************************************************************************\
 |*  Theory of single segment producer-consumer using binary semaphores                                         *|
 |***************************************************************************************************************|
@@ -42,21 +49,68 @@
 |*       (1,0)  -(0,0)-> (0,1)*                                                                                *|
 \***************************************************************************************************************/
 
+/***************************************************************************************************************\
+|*  Owner death                                                                                                *|
+|***************************************************************************************************************|
+|*  A process that dies inside (0,0) - after its sem_wait and before its sem_post - would leave both           *|
+|*  semaphores at zero and every peer blocked forever. So whoever enters (0,0) records its pid in the          *|
+|*  channel_control_t at the end of the segment, and clears it just before posting. Blocked sides wait in      *|
+|*  slices of CHANNEL_CHECK_NS; after each slice they look at the recorded holder and, if kill(pid, 0) reports *|
+|*  that it no longer exists, take over: one of them (a CAS on the pid) clears the partially written chunk and *|
+|*  posts W, returning the channel to (0,1). The operation that noticed the death fails, so a multi-chunk      *|
+|*  send_item/recv_item is abandoned rather than stitched together across two peers, and the channel works     *|
+|*  again for the next message. Detection is by pid, so peers must share a pid namespace; a death in the few   *|
+|*  instructions between acquiring a semaphore and recording the pid (or clearing it and posting) is not seen. *|
+\***************************************************************************************************************/
+
 /************************************************************\
 |* Shared memory layout                                     *|
 |************************************************************|
 |* 1) unsigned id                                           *|
-|* 2) size_t chunk_size                                     *|
-|* 3) size_t total                                          *|
-|* 4) void*  data                                           *|
+|* 2) unsigned flags (CHUNK_*)                              *|
+|* 3) size_t chunk_size                                     *|
+|* 4) size_t total                                          *|
+|* 5) void*  data                                           *|
+|*    if flags & CHUNK_LZ: size_t clen + clen bytes of      *|
+|*    shm_lz.h block, chunk_size is the decoded size        *|
+|* 6) uint32_t crc32c of the stored bytes of 5), if         *|
+|*    flags & CHUNK_CRC32C                                  *|
+|* 7) channel_control_t at CHANNEL_CONTROL_OFFSET, the last *|
+|*    cache line of the segment                             *|
 \************************************************************/
 
 #define MAX_BYTES 4000000
 #define _MODE 0777
-static const size_t maxlen = MAX_BYTES - sizeof(unsigned) - sizeof(size_t) * 2 - sizeof(void *);
+#define CHUNK_ID_OFFSET 0
+#define CHUNK_FLAGS_OFFSET (sizeof(unsigned))
+#define CHUNK_LEN_OFFSET (sizeof(unsigned) * 2)
+#define CHUNK_TOTAL_OFFSET (sizeof(unsigned) * 2 + sizeof(size_t))
+#define CHUNK_DATA_OFFSET (sizeof(unsigned) * 2 + sizeof(size_t) * 2)
+#define CHUNK_TRAILER_SIZE (sizeof(uint32_t))
+/* chunk flags, written by the producer */
+#define CHUNK_CRC32C 0x1u
+#define CHUNK_LZ 0x2u
+/* channel options, see set_shared_memory_options() */
+#define OPT_CRC32C 0x1u
+#define OPT_LZ 0x2u
+/* chunks smaller than this are never compressed; compressed chunks must save at least 1/LZ_MIN_SAVING */
+#define LZ_MIN_INPUT 4096
+#define LZ_MIN_SAVING 16
+/* blocked sides check the holder's liveness this often */
+#define CHANNEL_CHECK_NS 2000000ull
 typedef enum _status {
     Sent = 1, Acked = 2
 } status_t;
+typedef enum _channel_role {
+    ChannelIdle = 0, ChannelWriting = 1, ChannelReading = 2
+} channel_role_t;
+typedef struct _channel_control {
+    volatile int32_t holder;        /* pid inside (R,W) = (0,0), 0 when nobody is */
+    volatile uint32_t role;         /* channel_role_t of the holder */
+    volatile uint64_t recoveries;   /* times the channel was taken back from a dead holder */
+} channel_control_t;
+#define CHANNEL_CONTROL_OFFSET ((MAX_BYTES - sizeof(channel_control_t)) & ~(size_t) 63)
+static const size_t maxlen = CHANNEL_CONTROL_OFFSET - CHUNK_DATA_OFFSET - CHUNK_TRAILER_SIZE;
 typedef struct _shared_memory {
     int fd;
     void *data;
@@ -65,6 +119,7 @@ typedef struct _shared_memory {
     size_t size;
     int id;
     size_t total;
+    unsigned options;
 } shared_memory_t;
 
 static inline int
@@ -72,6 +127,7 @@ create_shared_memory(shared_memory_t *self, const char *name, const char *write_
 {
     /* precondition: shared memory block never existed */
     /* postcondition: (R,W) = (0,1)                    */
+    shared_segment_t segment;
     assert(self);
     assert(name);
     assert(write_sem_name);
@@ -90,28 +146,14 @@ create_shared_memory(shared_memory_t *self, const char *name, const char *write_
         return 1;
     }
 
-    self->fd = shm_open(name, O_CREAT | O_RDWR, _MODE);
-    if (self->fd < 0) {
+    if (map_shared_segment(&segment, name, MAX_BYTES) != 0) {
         sem_unlink(write_sem_name);
         sem_unlink(read_sem_name);
-        shm_unlink(name);
-        return 1;
-    }
-    if (ftruncate(self->fd, MAX_BYTES) < 0) {
-        if (errno == EINVAL) goto ftruncate_failed_but_einval;
-        shm_unlink(name);
-        sem_unlink(write_sem_name);
-        sem_unlink(read_sem_name);
-        return 1;
-    }
-ftruncate_failed_but_einval:
-    self->data = mmap(NULL, MAX_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, self->fd, 0);
-    if (self->data == MAP_FAILED) {
-        sem_unlink(write_sem_name);
-        sem_unlink(read_sem_name);
-        shm_unlink(name);
         return 1;
     }
+    self->fd = segment.fd;
+    self->data = segment.data;
+    self->options = 0;
     return 0;
 }
 
@@ -120,6 +162,7 @@ open_shared_memory(shared_memory_t *self, const char *name, const char *write_se
 {
     /* precondition: shared memory block exists /\ (R,W) = (0,1)    */
     /* postcondition: fetch the existing shared memory block; does not change (R,W) */
+    shared_segment_t segment;
     assert(self);
     assert(name);
     assert(write_sem_name);
@@ -135,31 +178,100 @@ open_shared_memory(shared_memory_t *self, const char *name, const char *write_se
         sem_unlink(read_sem_name);
         return 1;
     }
-    self->fd = shm_open(name, O_RDWR | O_CREAT, _MODE);
-    if (self->fd < 0) {
+    if (map_shared_segment(&segment, name, MAX_BYTES) != 0) {
         sem_unlink(write_sem_name);
         sem_unlink(read_sem_name);
-        shm_unlink(name);
         return 1;
     }
-    if (ftruncate(self->fd, MAX_BYTES) < 0) {
-        if (errno == EINVAL) goto ftruncate_failed_but_einval1;
-        shm_unlink(name);
-        sem_unlink(write_sem_name);
-        sem_unlink(read_sem_name);
-        return 1;
+    self->fd = segment.fd;
+    self->data = segment.data;
+    self->options = 0;
+    return 0;
+}
+
+static inline void
+set_shared_memory_options(shared_memory_t *self, unsigned options)
+{
+    /* OPT_CRC32C: checksum every chunk this side writes; the reader verifies whatever the chunk header says */
+    /* OPT_LZ: compress chunks of at least LZ_MIN_INPUT bytes, sending them raw when they do not shrink */
+    assert(self);
+    self->options = options;
+}
+
+static inline channel_control_t *
+channel_control(shared_memory_t *self)
+{
+    return (channel_control_t *) ((char *) self->data + CHANNEL_CONTROL_OFFSET);
+}
+
+static inline int
+channel_sem_wait(sem_t *sem, uint64_t timeout_ns)
+{
+    /* returns 0 once the semaphore was taken, 1 on timeout */
+    if (sem_trywait(sem) == 0)
+        return 0;
+#ifdef __APPLE__
+    /* no sem_timedwait() on macOS: poll */
+    struct timespec nap = {0, 100000};
+    uint64_t waited;
+    for (waited = 0; waited < timeout_ns; waited += 100000) {
+        nanosleep(&nap, NULL);
+        if (sem_trywait(sem) == 0)
+            return 0;
     }
-ftruncate_failed_but_einval1:
-    self->data = mmap(NULL, MAX_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, self->fd, 0);
-    if (self->data == MAP_FAILED) {
-        shm_unlink(name);
-        sem_unlink(write_sem_name);
-        sem_unlink(read_sem_name);
+    return 1;
+#else
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += (time_t) (timeout_ns / 1000000000ull);
+    deadline.tv_nsec += (long) (timeout_ns % 1000000000ull);
+    if (deadline.tv_nsec >= 1000000000L) {
+        ++deadline.tv_sec;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    while (sem_timedwait(sem, &deadline) != 0)
+        if (errno != EINTR)
+            return 1;
+    return 0;
+#endif
+}
+
+static inline int
+channel_acquire(shared_memory_t *self, sem_t *sem, channel_role_t role)
+{
+    /* Enters (R,W) = (0,0) through sem and records this process as the holder. Returns 1 instead if the */
+    /* holder died while we waited; the channel has then been reset to (R,W) = (0,1) and nothing acquired. */
+    channel_control_t *ctl = channel_control(self);
+    char *base = (char *) self->data;
+    int32_t holder;
+    while (channel_sem_wait(sem, CHANNEL_CHECK_NS) != 0) {
+        holder = __atomic_load_n(&ctl->holder, __ATOMIC_ACQUIRE);
+        if (holder == 0 || kill(holder, 0) == 0 || errno != ESRCH)
+            continue;
+        /* several survivors may notice; only the one that clears the pid repairs the semaphores */
+        if (!__atomic_compare_exchange_n(&ctl->holder, &holder, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            continue;
+        SHM_TRACE(TracePeerDied, (uint64_t) holder, ctl->role);
+        memset(base, 0, CHUNK_DATA_OFFSET);
+        ctl->role = ChannelIdle;
+        __atomic_add_fetch(&ctl->recoveries, 1, __ATOMIC_RELAXED);
+        sem_post(self->w_sem);
         return 1;
     }
+    ctl->role = role;
+    __atomic_store_n(&ctl->holder, (int32_t) getpid(), __ATOMIC_RELEASE);
     return 0;
 }
 
+static inline void
+channel_release(shared_memory_t *self, sem_t *sem)
+{
+    channel_control_t *ctl = channel_control(self);
+    ctl->role = ChannelIdle;
+    __atomic_store_n(&ctl->holder, 0, __ATOMIC_RELEASE);
+    sem_post(sem);
+}
+
 static inline int
 write_shared_memory(shared_memory_t *self, void *data, size_t len, unsigned id, size_t total)
 {
@@ -168,20 +280,108 @@ write_shared_memory(shared_memory_t *self, void *data, size_t len, unsigned id,
     /* Postcondition: (R,W) = (1,0) */
     assert(self);
     assert(data);
-    assert(len > 0 && (len <= MAX_BYTES - sizeof(size_t) * 2 - sizeof(unsigned)));
+    assert(len > 0 && len <= maxlen);
     /* (R,W) = (0,0) */
     int rsemv, wsemv;
+    char *base = (char *) self->data;
+    unsigned flags = 0;
+    size_t clen = 0;
     sem_getvalue(self->r_sem, &rsemv);
     sem_getvalue(self->w_sem, &wsemv);
-    sem_wait(self->w_sem);
+    if (channel_acquire(self, self->w_sem, ChannelWriting) != 0)
+        return 1;
     /* In process */
-    memcpy(self->data, &id, sizeof(unsigned));
-    memcpy((self->data + (sizeof(unsigned))), &len, sizeof(size_t));
-    memcpy((self->data + (sizeof(unsigned) + sizeof(size_t))), &total, sizeof(size_t));
-    memcpy((self->data + (sizeof(unsigned) + sizeof(size_t) + sizeof(size_t))), data, len);
+    memcpy(base + CHUNK_ID_OFFSET, &id, sizeof(unsigned));
+    memcpy(base + CHUNK_LEN_OFFSET, &len, sizeof(size_t));
+    memcpy(base + CHUNK_TOTAL_OFFSET, &total, sizeof(size_t));
+    if ((self->options & OPT_LZ) && len >= LZ_MIN_INPUT)
+        clen = lz_compress(data, len, base + CHUNK_DATA_OFFSET + sizeof(size_t), len - len / LZ_MIN_SAVING);
+    if (clen != 0) {
+        /* compressed straight into the segment; only the stored bytes are checksummed */
+        memcpy(base + CHUNK_DATA_OFFSET, &clen, sizeof(size_t));
+        clen += sizeof(size_t);
+        flags |= CHUNK_LZ;
+        if (self->options & OPT_CRC32C) {
+            uint32_t crc = crc32c(0, base + CHUNK_DATA_OFFSET, clen);
+            memcpy(base + CHUNK_DATA_OFFSET + clen, &crc, sizeof(uint32_t));
+            flags |= CHUNK_CRC32C;
+        }
+    } else if (self->options & OPT_CRC32C) {
+        /* checksum computed while copying, so the payload is only touched once */
+        uint32_t crc = crc32c_copy(base + CHUNK_DATA_OFFSET, data, len, 0);
+        memcpy(base + CHUNK_DATA_OFFSET + len, &crc, sizeof(uint32_t));
+        flags |= CHUNK_CRC32C;
+    } else
+        memcpy(base + CHUNK_DATA_OFFSET, data, len);
+    memcpy(base + CHUNK_FLAGS_OFFSET, &flags, sizeof(unsigned));
     /* (R,W) = (1,0) */
-    sem_post(self->r_sem);
+    channel_release(self, self->r_sem);
+    return 0;
+}
+
+static inline int
+read_chunk(shared_memory_t *self, void **data, size_t cap, size_t *len, size_t *total_chunk, unsigned *id)
+{
+    /* Reads one chunk. If *data is NULL a buffer of the chunk's size is allocated, otherwise the chunk */
+    /* is copied to *data and must fit in cap bytes. The slot is released even when the chunk is rejected */
+    /* so that a corrupt chunk cannot wedge the channel in (R,W) = (0,0). */
+    char *base = (char *) self->data;
+    char *stored = base + CHUNK_DATA_OFFSET;
+    unsigned flags;
+    uint32_t crc, expected;
+    size_t stored_len, clen = 0;
+    int allocated = 0;
+    if (channel_acquire(self, self->r_sem, ChannelReading) != 0) {
+        SHM_TRACE(TraceRecvFailed, 0, 0);
+        return 1;
+    }
+    /* In process */
+    memcpy(id, base + CHUNK_ID_OFFSET, sizeof(unsigned));
+    memcpy(&flags, base + CHUNK_FLAGS_OFFSET, sizeof(unsigned));
+    memcpy(len, base + CHUNK_LEN_OFFSET, sizeof(size_t));
+    memcpy(total_chunk, base + CHUNK_TOTAL_OFFSET, sizeof(size_t));
+    if (flags & CHUNK_LZ)
+        memcpy(&clen, stored, sizeof(size_t));
+    stored_len = flags & CHUNK_LZ ? clen + sizeof(size_t) : *len;
+    if (*len <= 0 || *len > maxlen || *total_chunk == 0 || (*data != NULL && *len > cap)
+        || ((flags & CHUNK_LZ) && (clen == 0 || clen >= *len || clen > maxlen - sizeof(size_t)))) {
+        SHM_TRACE(TraceBadChunk, *id, *len);
+        memset(base, 0, CHANNEL_CONTROL_OFFSET);
+        channel_release(self, self->w_sem);
+        return 1;
+    }
+    if (*data == NULL) {
+        *data = malloc(*len);
+        if (*data == NULL)
+            goto read_chunk_failed;
+        allocated = 1;
+    }
+    if (flags & CHUNK_CRC32C) {
+        memcpy(&expected, stored + stored_len, sizeof(uint32_t));
+        /* raw chunks are checked during the copy, compressed ones before they reach the decoder */
+        crc = flags & CHUNK_LZ ? crc32c(0, stored, stored_len) : crc32c_copy(*data, stored, *len, 0);
+        if (crc != expected) {
+            SHM_TRACE(TraceChecksumMismatch, *id, *len);
+            goto read_chunk_failed;
+        }
+    } else if (!(flags & CHUNK_LZ))
+        memcpy(*data, stored, *len);
+    if ((flags & CHUNK_LZ) && lz_decompress(stored + sizeof(size_t), clen, *data, *len) != 0) {
+        SHM_TRACE(TraceBadChunk, *id, clen);
+        goto read_chunk_failed;
+    }
+    /* (R,W) = (0,1); the rest of the segment is still zero from earlier reads */
+    memset(base, 0, CHUNK_DATA_OFFSET + stored_len + CHUNK_TRAILER_SIZE);
+    channel_release(self, self->w_sem);
     return 0;
+read_chunk_failed:
+    if (allocated) {
+        free(*data);
+        *data = NULL;
+    }
+    memset(base, 0, CHUNK_DATA_OFFSET + stored_len + CHUNK_TRAILER_SIZE);
+    channel_release(self, self->w_sem);
+    return 1;
 }
 
 static inline int
@@ -191,6 +391,7 @@ read_shared_memory(shared_memory_t *self, void **data, size_t *len, size_t *tota
     /* State: (R,W) = (0,0) */
     /* Postcondition: (R,W) = (0,1) */
     assert(self);
+    assert(data);
     assert(len);
     assert(total_chunk);
     assert(id);
@@ -198,23 +399,8 @@ read_shared_memory(shared_memory_t *self, void **data, size_t *len, size_t *tota
     int rsemv, wsemv;
     sem_getvalue(self->r_sem, &rsemv);
     sem_getvalue(self->w_sem, &wsemv);
-    sem_wait(self->r_sem);
-    /* In process */
-    *id = *((unsigned *) self->data);
-    *len = *((size_t *) (self->data + (sizeof(unsigned))));
-    *total_chunk = *((size_t *) (self->data + (sizeof(unsigned) + sizeof(size_t))));
-    if (*len <= 0 || *len > MAX_BYTES) {
-        return 1;
-    }
-    *data = malloc(*len);
-    if (*data == NULL) {
-        return 1;
-    }
-    memcpy(*data, (self->data + (sizeof(unsigned) + sizeof(size_t) + sizeof(size_t))), *len);
-    /* (R,W) = (0,1) */
-    memset(self->data, 0, MAX_BYTES);
-    sem_post(self->w_sem);
-    return 0;
+    *data = NULL;
+    return read_chunk(self, data, 0, len, total_chunk, id);
 }
 
 static inline int
@@ -234,8 +420,9 @@ send_item(shared_memory_t *self, void *data, size_t len)
     for (i = 0; i < chunks; ++i) {
         ustart = i * maxlen;
         ulen = chunks == 1 ? len : (i == chunks - 1 ? (len - (maxlen * i)) : maxlen);
-        int r = write_shared_memory(self, data + ustart, ulen, (unsigned) i, chunks);
+        int r = write_shared_memory(self, (char *) data + ustart, ulen, (unsigned) i, chunks);
         if (r != 0) {
+            SHM_TRACE(TraceSendFailed, i, chunks);
             return 1;
         }
     }
@@ -245,6 +432,9 @@ send_item(shared_memory_t *self, void *data, size_t len)
 static inline int
 recv_item(shared_memory_t *self, void **data, size_t *len)
 {
+    /* Every chunk header is checked against the first one: ids must arrive in order, `total` must not */
+    /* change and all but the last chunk must be full. Chunks after the first are read straight into the */
+    /* reassembly buffer. */
     assert(self);
     assert(self->data);
     assert(self->r_sem);
@@ -254,40 +444,45 @@ recv_item(shared_memory_t *self, void **data, size_t *len)
     size_t per_chunk_size;
     size_t ttotal;
     void *temp;
+    void *dst;
     unsigned id;
     int rt = read_shared_memory(self, &temp, &size_per_chunk, &total_chunk, &id);
     if (rt != 0) {
+        SHM_TRACE(TraceRecvFailed, 0, 0);
+        return 1;
+    }
+    if (id != 0 || (total_chunk > 1 && size_per_chunk != maxlen) || total_chunk > SIZE_MAX / maxlen) {
+        SHM_TRACE(TraceBadChunk, id, total_chunk);
         free(temp);
-        dzlog_debug("recv failure");
         return 1;
     }
-    *data = malloc(total_chunk * size_per_chunk);
-    memcpy(*data, temp, size_per_chunk);
-    free(temp);
-    size_t i;
-    for (i = 1; i < total_chunk - 1; ++i) {
-        void *_temp;
-        rt = read_shared_memory(self, &_temp, &per_chunk_size, &ttotal, &id);
-        memcpy(((*data) + i * size_per_chunk), _temp, per_chunk_size);
-        free(_temp);
-        if (rt != 0) {
-            free(*data);
-        }
+    if (total_chunk == 1) {
+        *data = temp;
+        *len = size_per_chunk;
+        return 0;
+    }
+    *data = realloc(temp, total_chunk * size_per_chunk);
+    if (*data == NULL) {
+        free(temp);
+        return 1;
     }
-    if (total_chunk > 1) {
-        void *_temp;
-        rt = read_shared_memory(self, &_temp, &per_chunk_size, &ttotal, &id);
-        memcpy(((*data) + i * size_per_chunk), _temp, per_chunk_size);
-        if (rt != 0) {
+    size_t i;
+    for (i = 1; i < total_chunk; ++i) {
+        dst = (char *) *data + i * size_per_chunk;
+        rt = read_chunk(self, &dst, size_per_chunk, &per_chunk_size, &ttotal, &id);
+        if (rt != 0 || id != i || ttotal != total_chunk || (i < total_chunk - 1 && per_chunk_size != size_per_chunk)) {
+            SHM_TRACE(TraceBadChunk, i, id);
             free(*data);
+            *data = NULL;
             return 1;
         }
-        if (per_chunk_size != size_per_chunk) {
-            *data = realloc(*data, (total_chunk - 1) * size_per_chunk + per_chunk_size);
-        }
-        *len = (total_chunk - 1) * size_per_chunk + per_chunk_size;
-    } else
-        *len = total_chunk * size_per_chunk;
+    }
+    *len = (total_chunk - 1) * size_per_chunk + per_chunk_size;
+    if (per_chunk_size != size_per_chunk) {
+        temp = realloc(*data, *len);
+        if (temp != NULL)
+            *data = temp;
+    }
     return 0;
 }
 
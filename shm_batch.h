@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ */
+
+#ifndef P2PMD_SHM_BATCH_H
+#define P2PMD_SHM_BATCH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shared_memory.h"
+
+/***************************************************************************************************************\
+|*  Atomic batches of messages over a shared_memory_t channel                                                  *|
+|***************************************************************************************************************|
+|*  send_batch() packs a group of messages into one item: a batch_header_t, the length of every message, then  *|
+|*  the messages themselves, each padded to BATCH_ALIGN. A batch that fits one chunk is gathered straight      *|
+|*  into the segment under a single (R,W) handshake, so the whole group costs one copy per message, one post   *|
+|*  and at most one wakeup. Larger batches are packed into a temporary buffer and sent as a multi-chunk item.  *|
+|*  Either way the consumer sees all of the batch or none of it: recv_batch() returns only after the last      *|
+|*  chunk arrived and the directory checked out, and fails as a whole otherwise.                               *|
+|*  Batches gathered into the segment honour OPT_CRC32C but are never compressed. A channel carries either     *|
+|*  batches or plain items; recv_batch() rejects (and consumes) anything that is not a batch.                  *|
+\***************************************************************************************************************/
+
+/************************************************************\
+|* Batch layout                                             *|
+|************************************************************|
+|* 1) batch_header_t                                        *|
+|* 2) uint64_t lens[count]                                  *|
+|* 3) message i at the next multiple of BATCH_ALIGN after   *|
+|*    message i-1                                           *|
+\************************************************************/
+
+#define BATCH_MAGIC 0x42415443u
+#define BATCH_ALIGN 8
+#define BATCH_MAX_MESSAGES 65536
+
+typedef struct _batch_header {
+    uint32_t magic;
+    uint32_t count;
+    uint64_t len;
+} batch_header_t;
+
+typedef struct _batch_msg {
+    const void *data;
+    size_t len;
+} batch_msg_t;
+
+typedef struct _batch {
+    void *buf;
+    size_t len;
+    uint32_t count;
+    batch_msg_t *msgs;          /* msgs[i].data points into buf */
+} batch_t;
+
+static inline size_t
+batch_align(size_t len)
+{
+    return (len + BATCH_ALIGN - 1) & ~(size_t) (BATCH_ALIGN - 1);
+}
+
+static inline size_t
+batch_size(const batch_msg_t *msgs, uint32_t count)
+{
+    /* bytes send_batch() will send for these messages */
+    size_t size = sizeof(batch_header_t) + sizeof(uint64_t) * count;
+    uint32_t i;
+    for (i = 0; i < count; ++i)
+        size += batch_align(msgs[i].len);
+    return size;
+}
+
+static inline uint32_t
+batch_pack(char *dst, const batch_msg_t *msgs, uint32_t count, size_t size, int checksum)
+{
+    /* writes the batch to dst; returns the CRC32C of the written bytes if checksum is set */
+    static const char zeros[BATCH_ALIGN] = {0};
+    batch_header_t hdr;
+    uint64_t len;
+    uint32_t crc = 0, i;
+    size_t off = sizeof(batch_header_t) + sizeof(uint64_t) * count, pad;
+    hdr.magic = BATCH_MAGIC;
+    hdr.count = count;
+    hdr.len = size;
+    memcpy(dst, &hdr, sizeof(hdr));
+    for (i = 0; i < count; ++i) {
+        len = msgs[i].len;
+        memcpy(dst + sizeof(batch_header_t) + sizeof(uint64_t) * i, &len, sizeof(uint64_t));
+    }
+    if (checksum)
+        crc = crc32c(0, dst, off);
+    for (i = 0; i < count; ++i) {
+        pad = batch_align(msgs[i].len) - msgs[i].len;
+        if (checksum) {
+            crc = crc32c_copy(dst + off, msgs[i].data, msgs[i].len, crc);
+            crc = crc32c_copy(dst + off + msgs[i].len, zeros, pad, crc);
+        } else {
+            memcpy(dst + off, msgs[i].data, msgs[i].len);
+            memset(dst + off + msgs[i].len, 0, pad);
+        }
+        off += msgs[i].len + pad;
+    }
+    return crc;
+}
+
+static inline int
+batch_write_chunk(shared_memory_t *self, const batch_msg_t *msgs, uint32_t count, size_t size)
+{
+    /* Precondition: (R,W) = (0,1); Postcondition: (R,W) = (1,0), the batch being one complete chunk */
+    char *base = (char *) self->data;
+    unsigned id = 0, flags = 0;
+    size_t total = 1;
+    uint32_t crc;
+    if (channel_acquire(self, self->w_sem, ChannelWriting) != 0)
+        return 1;
+    memcpy(base + CHUNK_ID_OFFSET, &id, sizeof(unsigned));
+    memcpy(base + CHUNK_LEN_OFFSET, &size, sizeof(size_t));
+    memcpy(base + CHUNK_TOTAL_OFFSET, &total, sizeof(size_t));
+    crc = batch_pack(base + CHUNK_DATA_OFFSET, msgs, count, size, (self->options & OPT_CRC32C) != 0);
+    if (self->options & OPT_CRC32C) {
+        memcpy(base + CHUNK_DATA_OFFSET + size, &crc, sizeof(uint32_t));
+        flags |= CHUNK_CRC32C;
+    }
+    memcpy(base + CHUNK_FLAGS_OFFSET, &flags, sizeof(unsigned));
+    channel_release(self, self->r_sem);
+    return 0;
+}
+
+static inline int
+send_batch(shared_memory_t *self, const batch_msg_t *msgs, uint32_t count)
+{
+    /* sends count messages that the consumer receives together; zero-length messages are allowed */
+    size_t size;
+    char *buf;
+    int rt;
+    assert(self);
+    assert(msgs);
+    if (count == 0 || count > BATCH_MAX_MESSAGES)
+        return 1;
+    size = batch_size(msgs, count);
+    if (size <= maxlen)
+        return batch_write_chunk(self, msgs, count, size);
+    buf = (char *) malloc(size);
+    if (buf == NULL)
+        return 1;
+    batch_pack(buf, msgs, count, size, 0);
+    rt = send_item(self, buf, size);
+    free(buf);
+    return rt;
+}
+
+static inline void
+free_batch(batch_t *batch)
+{
+    assert(batch);
+    free(batch->buf);
+    free(batch->msgs);
+    memset(batch, 0, sizeof(*batch));
+}
+
+static inline int
+recv_batch(shared_memory_t *self, batch_t *batch)
+{
+    /* receives a whole batch; release it with free_batch() */
+    batch_header_t hdr;
+    const char *p;
+    uint64_t len;
+    size_t off;
+    uint32_t i;
+    assert(self);
+    assert(batch);
+    memset(batch, 0, sizeof(*batch));
+    if (recv_item(self, &batch->buf, &batch->len) != 0)
+        return 1;
+    p = (const char *) batch->buf;
+    if (batch->len < sizeof(batch_header_t))
+        goto recv_batch_failed;
+    memcpy(&hdr, p, sizeof(hdr));
+    if (hdr.magic != BATCH_MAGIC || hdr.count == 0 || hdr.count > BATCH_MAX_MESSAGES || hdr.len != batch->len)
+        goto recv_batch_failed;
+    off = sizeof(batch_header_t) + sizeof(uint64_t) * hdr.count;
+    if (off > batch->len)
+        goto recv_batch_failed;
+    batch->msgs = (batch_msg_t *) malloc(sizeof(batch_msg_t) * hdr.count);
+    if (batch->msgs == NULL)
+        goto recv_batch_failed;
+    for (i = 0; i < hdr.count; ++i) {
+        memcpy(&len, p + sizeof(batch_header_t) + sizeof(uint64_t) * i, sizeof(uint64_t));
+        if (len > batch->len - off || batch_align(len) > batch->len - off)
+            goto recv_batch_failed;
+        batch->msgs[i].data = p + off;
+        batch->msgs[i].len = len;
+        off += batch_align(len);
+    }
+    if (off != batch->len)
+        goto recv_batch_failed;
+    batch->count = hdr.count;
+    return 0;
+recv_batch_failed:
+    SHM_TRACE(TraceBadChunk, 0, batch->len);
+    free_batch(batch);
+    return 1;
+}
+
+#endif //P2PMD_SHM_BATCH_H
@@ -0,0 +1,337 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ */
+
+#ifndef P2PMD_SHM_BLOB_H
+#define P2PMD_SHM_BLOB_H
+
+#include <stdint.h>
+#include "shared_memory.h"
+#include "shm_wait.h"
+#include "shm_hash.h"
+
+/***************************************************************************************************************\
+|*  Content-addressed blob store                                                                               *|
+|***************************************************************************************************************|
+|*  A segment holding an open-addressing index of (128-bit hash, length) keys and an append-only arena.        *|
+|*  blob_put() hashes the content; if an equal blob is already stored nothing is copied, otherwise the bytes   *|
+|*  are appended to the arena once. send_blob() then ships only the 32-byte key over an ordinary channel and   *|
+|*  recv_blob() returns a pointer to the stored bytes in the receiver's mapping - no copy on either side       *|
+|*  after the first send. Blobs are immutable and never evicted: size the arena for the working set. A blob    *|
+|*  that cannot be stored (full arena, collision) is sent inline instead, tagged so that recv_blob() tells it  *|
+|*  from a key and hands it back as a buffer the caller frees. An item sent on the channel with plain          *|
+|*  send_item() comes back the same way, unless it happens to start with one of the two tags.                  *|
+|*                                                                                                             *|
+|*  Slots go Empty -> Writing (claimed by CAS) -> Ready (published with release). A put that probes into a     *|
+|*  Writing slot waits for it to become Ready before comparing, so two processes storing the same content      *|
+|*  concurrently end up with one copy. Equal hashes are confirmed with memcmp, so a hash collision makes       *|
+|*  blob_put() fail rather than alias two different blobs. A put that finds the arena full leaves its slot as  *|
+|*  a dead entry that never matches, so probe chains stay intact, and fails. A process that dies between       *|
+|*  claiming a slot and publishing it leaves the slot Writing for good; puts and gets that probe into it give  *|
+|*  up after SHM_SLOT_WAIT_NS and fail.                                                                        *|
+\***************************************************************************************************************/
+
+#define BLOB_MAGIC 0x424c4f42u
+#define BLOB_REF_MAGIC 0x42524546u
+#define BLOB_INLINE_MAGIC 0x42494e4cu
+#define BLOB_ALIGN 64
+#define BLOB_DEAD_LEN UINT64_MAX
+
+typedef enum _blob_state {
+    BlobEmpty = 0, BlobWriting = 1, BlobReady = 2
+} blob_state_t;
+
+typedef struct _blob_key {
+    uint64_t lo;
+    uint64_t hi;
+    uint64_t len;
+} blob_key_t;
+
+typedef struct _blob_slot {
+    volatile uint32_t state;
+    uint32_t pad;
+    blob_key_t key;
+    uint64_t off;
+} blob_slot_t;
+
+typedef struct _blob_header {
+    volatile uint32_t magic;
+    uint32_t nslots;
+    uint64_t arena_size;
+    volatile uint64_t arena_used;
+    volatile uint64_t count;
+} blob_header_t;
+
+typedef struct _blob_ref {
+    uint32_t magic;
+    uint32_t pad;
+    blob_key_t key;
+} blob_ref_t;
+
+typedef struct _blob_inline {
+    uint32_t magic;             /* followed by the payload itself */
+    uint32_t pad;
+} blob_inline_t;
+
+typedef struct _blob_store {
+    shared_segment_t segment;
+    blob_header_t *hdr;
+    blob_slot_t *slots;
+    char *arena;
+    uint32_t mask;
+} blob_store_t;
+
+static inline uint64_t
+blob_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline void
+blob_hash(const void *data, size_t len, blob_key_t *key)
+{
+    /* two independent 64-bit multiply-rotate lanes over 16-byte blocks (MurmurHash3 x64-128 style) */
+    const unsigned char *p = (const unsigned char *) data;
+    uint64_t h1 = 0x9e3779b97f4a7c15ull ^ len, h2 = 0x6a09e667f3bcc909ull ^ len, k1, k2;
+    const uint64_t c1 = 0x87c37b91114253d5ull, c2 = 0x4cf5ad432745937full;
+    size_t i, tail;
+    for (i = 0; i + 16 <= len; i += 16) {
+        memcpy(&k1, p + i, 8);
+        memcpy(&k2, p + i + 8, 8);
+        h1 ^= blob_rotl(k1 * c1, 31) * c2;
+        h1 = (blob_rotl(h1, 27) + h2) * 5 + 0x52dce729;
+        h2 ^= blob_rotl(k2 * c2, 33) * c1;
+        h2 = (blob_rotl(h2, 31) + h1) * 5 + 0x38495ab5;
+    }
+    k1 = k2 = 0;
+    tail = len - i;
+    memcpy(&k1, p + i, tail > 8 ? 8 : tail);
+    if (tail > 8)
+        memcpy(&k2, p + i + 8, tail - 8);
+    h1 ^= blob_rotl(k1 * c1, 31) * c2;
+    h2 ^= blob_rotl(k2 * c2, 33) * c1;
+    h1 += h2;
+    h2 += h1;
+    h1 = shm_hash_mix(h1);
+    h2 = shm_hash_mix(h2);
+    h1 += h2;
+    h2 += h1;
+    key->lo = h1;
+    key->hi = h2;
+    key->len = len;
+}
+
+static inline int
+blob_key_equal(const blob_key_t *a, const blob_key_t *b)
+{
+    return a->lo == b->lo && a->hi == b->hi && a->len == b->len;
+}
+
+static inline void
+blob_bind(blob_store_t *self)
+{
+    self->slots = (blob_slot_t *) (self->hdr + 1);
+    self->arena = (char *) (self->slots + self->hdr->nslots);
+    self->arena = (char *) (((uintptr_t) self->arena + BLOB_ALIGN - 1) & ~(uintptr_t) (BLOB_ALIGN - 1));
+    self->mask = self->hdr->nslots - 1;
+}
+
+static inline int
+create_blob_store(blob_store_t *self, const char *name, uint32_t nslots, size_t arena_size)
+{
+    /* precondition: nslots is a power of two */
+    size_t size;
+    assert(self);
+    assert(name);
+    assert(nslots > 0 && (nslots & (nslots - 1)) == 0);
+    size = sizeof(blob_header_t) + sizeof(blob_slot_t) * nslots + BLOB_ALIGN + arena_size;
+    if (map_shared_segment(&self->segment, name, size) != 0)
+        return 1;
+    memset(self->segment.data, 0, sizeof(blob_header_t) + sizeof(blob_slot_t) * nslots);
+    self->hdr = (blob_header_t *) self->segment.data;
+    self->hdr->nslots = nslots;
+    self->hdr->arena_size = arena_size;
+    blob_bind(self);
+    __atomic_store_n(&self->hdr->magic, BLOB_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static inline int
+open_blob_store(blob_store_t *self, const char *name)
+{
+    assert(self);
+    assert(name);
+    if (attach_shared_segment(&self->segment, name) != 0)
+        return 1;
+    self->hdr = (blob_header_t *) self->segment.data;
+    if (__atomic_load_n(&self->hdr->magic, __ATOMIC_ACQUIRE) != BLOB_MAGIC
+        || sizeof(blob_header_t) + sizeof(blob_slot_t) * (size_t) self->hdr->nslots + BLOB_ALIGN
+           + self->hdr->arena_size > self->segment.size) {
+        detach_shared_segment(&self->segment);
+        return 1;
+    }
+    blob_bind(self);
+    return 0;
+}
+
+static inline void
+detach_blob_store(blob_store_t *self)
+{
+    assert(self);
+    detach_shared_segment(&self->segment);
+}
+
+static inline void
+close_blob_store(const char *name)
+{
+    assert(name);
+    shm_unlink(name);
+}
+
+static inline int
+blob_get(blob_store_t *self, const blob_key_t *key, const void **data)
+{
+    /* returns 0 with *data pointing into the store, 1 if the blob is not stored */
+    uint32_t i, n;
+    assert(self);
+    assert(key);
+    assert(data);
+    for (i = (uint32_t) key->lo & self->mask, n = 0; n <= self->mask; i = (i + 1) & self->mask, ++n) {
+        blob_slot_t *slot = &self->slots[i];
+        uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        if (state == BlobEmpty)
+            return 1;
+        if (state == BlobWriting && shm_slot_wait_ready(&slot->state, BlobWriting) != 0)
+            return 1;
+        if (blob_key_equal(&slot->key, key)) {
+            *data = self->arena + slot->off;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static inline int
+blob_put(blob_store_t *self, const void *data, size_t len, blob_key_t *key)
+{
+    /* stores data unless an identical blob exists; returns 0 with *key set, 1 if full, on a collision or stuck */
+    uint32_t i, n;
+    assert(self);
+    assert(data || len == 0);
+    assert(key);
+    blob_hash(data, len, key);
+    for (i = (uint32_t) key->lo & self->mask, n = 0; n <= self->mask; i = (i + 1) & self->mask, ++n) {
+        blob_slot_t *slot = &self->slots[i];
+        uint32_t expected = BlobEmpty;
+        uint64_t off, need;
+        if (__atomic_compare_exchange_n(&slot->state, &expected, BlobWriting, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            need = (len + BLOB_ALIGN - 1) & ~(uint64_t) (BLOB_ALIGN - 1);
+            off = __atomic_load_n(&self->hdr->arena_used, __ATOMIC_RELAXED);
+            do {
+                if (off + need > self->hdr->arena_size) {
+                    /* arena exhausted: publish the slot as a dead entry so probe chains stay intact */
+                    slot->key.lo = slot->key.hi = 0;
+                    slot->key.len = BLOB_DEAD_LEN;
+                    __atomic_store_n(&slot->state, BlobReady, __ATOMIC_RELEASE);
+                    return 1;
+                }
+            } while (!__atomic_compare_exchange_n(&self->hdr->arena_used, &off, off + need, 1,
+                                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+            memcpy(self->arena + off, data, len);
+            slot->key = *key;
+            slot->off = off;
+            __atomic_add_fetch(&self->hdr->count, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&slot->state, BlobReady, __ATOMIC_RELEASE);
+            return 0;
+        }
+        if (expected == BlobWriting && shm_slot_wait_ready(&slot->state, BlobWriting) != 0)
+            return 1;
+        if (blob_key_equal(&slot->key, key))
+            return memcmp(self->arena + slot->off, data, len) == 0 ? 0 : 1;
+    }
+    return 1;
+}
+
+static inline int
+send_blob_key(shared_memory_t *self, const blob_key_t *key)
+{
+    blob_ref_t ref;
+    assert(key);
+    memset(&ref, 0, sizeof(ref));
+    ref.magic = BLOB_REF_MAGIC;
+    ref.key = *key;
+    return send_item(self, &ref, sizeof(ref));
+}
+
+static inline int
+send_blob_inline(shared_memory_t *self, const void *data, size_t len)
+{
+    /* sends the bytes themselves, tagged so that recv_blob() tells them from a key */
+    blob_inline_t tag;
+    char *msg;
+    int rt;
+    if (len > SIZE_MAX - sizeof(tag) || (msg = (char *) malloc(sizeof(tag) + len)) == NULL)
+        return 1;
+    memset(&tag, 0, sizeof(tag));
+    tag.magic = BLOB_INLINE_MAGIC;
+    memcpy(msg, &tag, sizeof(tag));
+    memcpy(msg + sizeof(tag), data, len);
+    rt = send_item(self, msg, sizeof(tag) + len);
+    free(msg);
+    return rt;
+}
+
+static inline int
+send_blob(shared_memory_t *self, blob_store_t *store, const void *data, size_t len, blob_key_t *key)
+{
+    /* Stores the blob if needed and sends its key; key may be NULL. If the blob cannot be stored the bytes */
+    /* are sent inline instead and *key is left untouched. Returns 1 only if nothing was sent. */
+    blob_key_t k;
+    if (blob_put(store, data, len, &k) != 0)
+        return send_blob_inline(self, data, len);
+    if (key)
+        *key = k;
+    return send_blob_key(self, &k);
+}
+
+static inline int
+recv_blob(shared_memory_t *self, blob_store_t *store, const void **data, size_t *len, int *owned)
+{
+    /* With *owned == 0, *data points into the blob store and stays valid while the store is mapped. With */
+    /* *owned == 1 it is a buffer the caller frees: a blob sent inline, or an item sent with send_item(). */
+    blob_ref_t *ref;
+    uint32_t magic = 0;
+    void *msg;
+    size_t msg_len;
+    assert(data);
+    assert(len);
+    assert(owned);
+    if (recv_item(self, &msg, &msg_len) != 0)
+        return 1;
+    if (msg_len >= sizeof(uint32_t))
+        memcpy(&magic, msg, sizeof(magic));
+    if (magic == BLOB_REF_MAGIC && msg_len == sizeof(blob_ref_t)) {
+        ref = (blob_ref_t *) msg;
+        if (blob_get(store, &ref->key, data) != 0) {
+            free(msg);
+            return 1;
+        }
+        *len = ref->key.len;
+        *owned = 0;
+        free(msg);
+        return 0;
+    }
+    if (magic == BLOB_INLINE_MAGIC && msg_len >= sizeof(blob_inline_t)) {
+        msg_len -= sizeof(blob_inline_t);
+        memmove(msg, (char *) msg + sizeof(blob_inline_t), msg_len);
+    }
+    *data = msg;
+    *len = msg_len;
+    *owned = 1;
+    return 0;
+}
+
+#endif //P2PMD_SHM_BLOB_H
@@ -0,0 +1,465 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ */
+
+#ifndef P2PMD_SHM_CACHE_H
+#define P2PMD_SHM_CACHE_H
+
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include "shm_segment.h"
+#include "shm_lock.h"
+#include "shm_hash.h"
+
+/***************************************************************************************************************\
+|*  Bounded shared cache with CLOCK eviction                                                                   *|
+|***************************************************************************************************************|
+|*  One segment holds a chained hash index, a fixed pool of entries and a slab area for keys and values, so    *|
+|*  several worker processes share one hot-data cache instead of each keeping a copy.                          *|
+|*                                                                                                             *|
+|*  Readers take no lock: every entry carries a sequence number that writers make odd while they change it,    *|
+|*  and cache_get() copies the value out and retries if the sequence moved. A reader that follows a chain      *|
+|*  while a writer relinks it may report a miss for a key that is present, never a wrong value. A hit sets     *|
+|*  the entry's CLOCK reference bit.                                                                           *|
+|*                                                                                                             *|
+|*  Writers serialise on a shm_mutex_t. Key and value share one block from a power-of-two size class (64 B     *|
+|*  upwards), managed as buddies: a put splits the smallest free block of its class or larger, and a freed     *|
+|*  block merges with its buddy while that is free, so space freed by small entries comes back for large       *|
+|*  ones. A byte per 64 B granule tags the free blocks so the buddy is found without a search. When no block   *|
+|*  fits, the CLOCK hand sweeps only the entries whose blocks are of the needed class or larger, so a single   *|
+|*  eviction frees a block that serves the put; only if there are none does it evict from any class until      *|
+|*  merges produce one. When no entry is free it sweeps all entries. The hand clears set reference bits and    *|
+|*  evicts the first entry whose bit is already clear.                                                         *|
+|*  The lock is not robust: a writer that dies inside cache_put() or cache_delete() leaves the cache locked.   *|
+\***************************************************************************************************************/
+
+/************************************************************\
+|* Cache layout                                             *|
+|************************************************************|
+|* 1) cache_header_t                                        *|
+|* 2) uint32_t buckets[nbuckets]: head entry index + 1      *|
+|* 3) cache_entry_t entries[nentries]                       *|
+|* 4) uint8_t map[slab_size / CACHE_MIN_BLOCK]: free tags   *|
+|* 5) slab area, CACHE_MIN_BLOCK aligned: per entry one     *|
+|*    block holding the key followed by the value           *|
+\************************************************************/
+
+#define CACHE_MAGIC 0x43414348u
+#define CACHE_MIN_BLOCK 64
+#define CACHE_CLASSES 24
+#define CACHE_FREE 0xffffffffu
+#define CACHE_READ_SPINS 64
+#define CACHE_MAP_FREE 0x80u
+
+typedef struct _cache_entry {
+    volatile uint32_t seq;      /* odd while a writer changes the entry */
+    volatile uint32_t next;     /* next entry in the bucket (index + 1), 0 at the end; free list when unused */
+    volatile uint32_t ref;      /* CLOCK reference bit */
+    uint32_t cls;               /* size class of the block, CACHE_FREE for an unused entry */
+    uint64_t hash;
+    uint64_t off;               /* of the block in the slab area */
+    uint32_t klen;
+    uint32_t vlen;
+} cache_entry_t;
+
+typedef struct _cache_header {
+    shm_mutex_t lock;
+    volatile uint32_t magic;
+    uint32_t nbuckets;
+    uint32_t nentries;
+    uint32_t hand;
+    uint64_t slab_size;
+    uint64_t slab_used;         /* bytes in allocated blocks */
+    uint32_t free_entries;      /* index + 1 */
+    uint32_t count;
+    uint64_t evictions;
+    uint64_t free_blocks[CACHE_CLASSES];    /* offset + 1; next and prev links are kept in the block */
+    uint32_t in_class[CACHE_CLASSES];       /* entries holding a block of each class */
+} cache_header_t;
+
+typedef struct _cache {
+    shared_segment_t segment;
+    cache_header_t *hdr;
+    volatile uint32_t *buckets;
+    cache_entry_t *entries;
+    uint8_t *map;               /* per CACHE_MIN_BLOCK granule: CACHE_MAP_FREE | class at a free block, else 0 */
+    char *slab;
+    uint32_t mask;
+    uint64_t hits;              /* of this handle */
+    uint64_t misses;
+} cache_t;
+
+static inline size_t
+cache_layout_size(uint32_t nbuckets, uint32_t nentries, uint64_t slab_size)
+{
+    /* everything before the slab area */
+    size_t size = sizeof(cache_header_t) + sizeof(uint32_t) * nbuckets + sizeof(cache_entry_t) * nentries
+                  + slab_size / CACHE_MIN_BLOCK;
+    return (size + CACHE_MIN_BLOCK - 1) & ~(size_t) (CACHE_MIN_BLOCK - 1);
+}
+
+static inline void
+cache_bind(cache_t *self)
+{
+    self->buckets = (volatile uint32_t *) (self->hdr + 1);
+    self->entries = (cache_entry_t *) (self->buckets + self->hdr->nbuckets);
+    self->map = (uint8_t *) (self->entries + self->hdr->nentries);
+    self->slab = (char *) self->hdr + cache_layout_size(self->hdr->nbuckets, self->hdr->nentries,
+                                                        self->hdr->slab_size);
+    self->mask = self->hdr->nbuckets - 1;
+    self->hits = self->misses = 0;
+}
+
+static inline void
+cache_push_block(cache_t *self, uint32_t cls, uint64_t off)
+{
+    /* precondition: lock held; puts a free block at the head of its class's list */
+    uint64_t link[2] = {self->hdr->free_blocks[cls], 0};   /* next, prev as offset + 1 */
+    uint64_t self_link = off + 1;
+    if (link[0] != 0)
+        memcpy(self->slab + link[0] - 1 + sizeof(uint64_t), &self_link, sizeof(uint64_t));
+    memcpy(self->slab + off, link, sizeof(link));
+    self->hdr->free_blocks[cls] = self_link;
+    self->map[off / CACHE_MIN_BLOCK] = (uint8_t) (CACHE_MAP_FREE | cls);
+}
+
+static inline void
+cache_remove_block(cache_t *self, uint32_t cls, uint64_t off)
+{
+    /* precondition: lock held; takes a free block off its class's list, wherever it is */
+    uint64_t link[2];
+    memcpy(link, self->slab + off, sizeof(link));
+    if (link[1] != 0)
+        memcpy(self->slab + link[1] - 1, &link[0], sizeof(uint64_t));
+    else
+        self->hdr->free_blocks[cls] = link[0];
+    if (link[0] != 0)
+        memcpy(self->slab + link[0] - 1 + sizeof(uint64_t), &link[1], sizeof(uint64_t));
+    self->map[off / CACHE_MIN_BLOCK] = 0;
+}
+
+static inline void
+cache_free_block(cache_t *self, uint32_t cls, uint64_t off)
+{
+    /* precondition: lock held; returns a block, merging it with its free buddy as far as possible */
+    uint64_t buddy;
+    self->hdr->slab_used -= (uint64_t) CACHE_MIN_BLOCK << cls;
+    while (cls + 1 < CACHE_CLASSES) {
+        buddy = off ^ ((uint64_t) CACHE_MIN_BLOCK << cls);
+        if (buddy + ((uint64_t) CACHE_MIN_BLOCK << cls) > self->hdr->slab_size
+            || self->map[buddy / CACHE_MIN_BLOCK] != (CACHE_MAP_FREE | cls))
+            break;
+        cache_remove_block(self, cls, buddy);
+        off &= ~((uint64_t) CACHE_MIN_BLOCK << cls);
+        ++cls;
+    }
+    cache_push_block(self, cls, off);
+}
+
+static inline void
+cache_init_blocks(cache_t *self)
+{
+    /* cuts the slab area into the largest blocks aligned to their own size */
+    uint64_t off = 0, size;
+    uint32_t cls;
+    while (off < self->hdr->slab_size) {
+        for (cls = CACHE_CLASSES - 1;; --cls) {
+            size = (uint64_t) CACHE_MIN_BLOCK << cls;
+            if (off % size == 0 && size <= self->hdr->slab_size - off)
+                break;
+        }
+        cache_push_block(self, cls, off);
+        off += size;
+    }
+}
+
+static inline int
+cache_alloc_block(cache_t *self, uint32_t cls, uint64_t *off)
+{
+    /* precondition: lock held; takes a block of cls, splitting the smallest larger free block if needed */
+    uint32_t k = cls;
+    while (k < CACHE_CLASSES && self->hdr->free_blocks[k] == 0)
+        ++k;
+    if (k == CACHE_CLASSES)
+        return 1;
+    *off = self->hdr->free_blocks[k] - 1;
+    cache_remove_block(self, k, *off);
+    while (k-- > cls)
+        cache_push_block(self, k, *off + ((uint64_t) CACHE_MIN_BLOCK << k));
+    self->hdr->slab_used += (uint64_t) CACHE_MIN_BLOCK << cls;
+    return 0;
+}
+
+static inline int
+create_cache(cache_t *self, const char *name, uint32_t nbuckets, uint32_t nentries, size_t slab_size)
+{
+    /* precondition: nbuckets is a power of two; at most nentries items and slab_size bytes of blocks */
+    size_t size;
+    uint32_t i;
+    assert(self);
+    assert(name);
+    assert(nbuckets > 0 && (nbuckets & (nbuckets - 1)) == 0);
+    assert(nentries > 0);
+    slab_size &= ~(size_t) (CACHE_MIN_BLOCK - 1);
+    size = cache_layout_size(nbuckets, nentries, slab_size) + slab_size;
+    if (map_shared_segment(&self->segment, name, size) != 0)
+        return 1;
+    memset(self->segment.data, 0, cache_layout_size(nbuckets, nentries, slab_size));
+    self->hdr = (cache_header_t *) self->segment.data;
+    shm_mutex_init(&self->hdr->lock);
+    self->hdr->nbuckets = nbuckets;
+    self->hdr->nentries = nentries;
+    self->hdr->slab_size = slab_size;
+    cache_bind(self);
+    for (i = 0; i < nentries; ++i) {
+        self->entries[i].cls = CACHE_FREE;
+        self->entries[i].next = i + 1 < nentries ? i + 2 : 0;
+    }
+    self->hdr->free_entries = 1;
+    cache_init_blocks(self);
+    __atomic_store_n(&self->hdr->magic, CACHE_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static inline int
+open_cache(cache_t *self, const char *name)
+{
+    assert(self);
+    assert(name);
+    if (attach_shared_segment(&self->segment, name) != 0)
+        return 1;
+    self->hdr = (cache_header_t *) self->segment.data;
+    if (__atomic_load_n(&self->hdr->magic, __ATOMIC_ACQUIRE) != CACHE_MAGIC
+        || cache_layout_size(self->hdr->nbuckets, self->hdr->nentries, self->hdr->slab_size) + self->hdr->slab_size
+           > self->segment.size) {
+        detach_shared_segment(&self->segment);
+        return 1;
+    }
+    cache_bind(self);
+    return 0;
+}
+
+static inline void
+detach_cache(cache_t *self)
+{
+    assert(self);
+    detach_shared_segment(&self->segment);
+}
+
+static inline void
+close_cache(const char *name)
+{
+    assert(name);
+    shm_unlink(name);
+}
+
+static inline int
+cache_get(cache_t *self, const void *key, size_t klen, void *buf, size_t cap, size_t *vlen)
+{
+    /* Copies the value of key into buf and returns 0. Returns 1 on a miss with *vlen = 0, or with *vlen set  */
+    /* to the value's length if it does not fit cap bytes.                                                    */
+    cache_entry_t *e;
+    uint64_t hash, off;
+    uint32_t idx, seq, n, len, steps;
+    unsigned spins = 0;
+    assert(self);
+    assert(key || klen == 0);
+    assert(vlen);
+    hash = shm_hash_bytes(key, klen);
+cache_get_retry:
+    idx = __atomic_load_n(&self->buckets[hash & self->mask], __ATOMIC_ACQUIRE);
+    for (steps = 0; idx != 0 && idx <= self->hdr->nentries && steps < self->hdr->nentries; ++steps) {
+        e = &self->entries[idx - 1];
+        seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            goto cache_get_busy;
+        n = __atomic_load_n(&e->next, __ATOMIC_RELAXED);
+        if (e->hash == hash && e->klen == klen && e->cls != CACHE_FREE) {
+            off = e->off;
+            len = e->vlen;
+            /* a torn entry may hold any offset: stay inside the slab area until the sequence is checked */
+            if (off > self->hdr->slab_size || klen + (uint64_t) len > self->hdr->slab_size - off)
+                goto cache_get_busy;
+            if (memcmp(self->slab + off, key, klen) == 0) {
+                if (len <= cap)
+                    memcpy(buf, self->slab + off + klen, len);
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq)
+                    goto cache_get_busy;
+                *vlen = len;
+                if (len > cap)
+                    return 1;
+                if (__atomic_load_n(&e->ref, __ATOMIC_RELAXED) == 0)
+                    __atomic_store_n(&e->ref, 1, __ATOMIC_RELAXED);
+                ++self->hits;
+                return 0;
+            }
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq)
+            goto cache_get_busy;
+        idx = n;
+    }
+    *vlen = 0;
+    ++self->misses;
+    return 1;
+cache_get_busy:
+    /* a writer is changing this entry; on a uniprocessor it cannot finish while we spin */
+    if (++spins % CACHE_READ_SPINS == 0)
+        sched_yield();
+    else
+        cpu_relax();
+    goto cache_get_retry;
+}
+
+static inline void
+cache_write_begin(cache_entry_t *e)
+{
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+cache_write_end(cache_entry_t *e)
+{
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t
+cache_class(size_t size)
+{
+    uint32_t cls = 0;
+    while (cls < CACHE_CLASSES && ((uint64_t) CACHE_MIN_BLOCK << cls) < size)
+        ++cls;
+    return cls;
+}
+
+static inline void
+cache_unlink(cache_t *self, uint32_t idx)
+{
+    /* precondition: lock held; removes the entry from its bucket and returns its block and the entry */
+    cache_entry_t *e = &self->entries[idx - 1];
+    volatile uint32_t *link = &self->buckets[e->hash & self->mask];
+    uint32_t cls = e->cls;
+    while (*link != idx)
+        link = &self->entries[*link - 1].next;
+    __atomic_store_n(link, e->next, __ATOMIC_RELEASE);
+    cache_write_begin(e);
+    cache_free_block(self, e->cls, e->off);
+    e->cls = CACHE_FREE;
+    e->hash = 0;
+    e->ref = 0;
+    e->next = self->hdr->free_entries;
+    cache_write_end(e);
+    self->hdr->free_entries = idx;
+    --self->hdr->in_class[cls];
+    --self->hdr->count;
+}
+
+static inline int
+cache_evict(cache_t *self, uint32_t min_cls)
+{
+    /* precondition: lock held; evicts by CLOCK one entry whose block is of class min_cls or larger, 1 if none */
+    cache_entry_t *e;
+    uint32_t n, cls, eligible = 0;
+    for (cls = min_cls; cls < CACHE_CLASSES; ++cls)
+        eligible += self->hdr->in_class[cls];
+    if (eligible == 0)
+        return 1;
+    for (n = 0; n <= 2 * self->hdr->nentries; ++n) {
+        e = &self->entries[self->hdr->hand];
+        self->hdr->hand = (self->hdr->hand + 1) % self->hdr->nentries;
+        if (e->cls == CACHE_FREE || e->cls < min_cls)
+            continue;
+        if (__atomic_load_n(&e->ref, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&e->ref, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        cache_unlink(self, (uint32_t) (e - self->entries) + 1);
+        ++self->hdr->evictions;
+        return 0;
+    }
+    return 1;
+}
+
+static inline uint32_t
+cache_lookup_locked(cache_t *self, const void *key, size_t klen, uint64_t hash)
+{
+    uint32_t idx = self->buckets[hash & self->mask];
+    while (idx != 0) {
+        cache_entry_t *e = &self->entries[idx - 1];
+        if (e->hash == hash && e->klen == klen && memcmp(self->slab + e->off, key, klen) == 0)
+            return idx;
+        idx = e->next;
+    }
+    return 0;
+}
+
+static inline int
+cache_put(cache_t *self, const void *key, size_t klen, const void *value, size_t vlen)
+{
+    /* inserts or replaces key, evicting as needed; 1 if the item can never fit the slab area */
+    cache_entry_t *e;
+    uint64_t hash, off;
+    uint32_t cls, idx;
+    assert(self);
+    assert(key || klen == 0);
+    assert(value || vlen == 0);
+    cls = cache_class(klen + vlen);
+    if (klen > UINT32_MAX || vlen > UINT32_MAX || cls >= CACHE_CLASSES
+        || ((uint64_t) CACHE_MIN_BLOCK << cls) > self->hdr->slab_size)
+        return 1;
+    hash = shm_hash_bytes(key, klen);
+    shm_mutex_lock(&self->hdr->lock);
+    idx = cache_lookup_locked(self, key, klen, hash);
+    if (idx != 0)
+        cache_unlink(self, idx);
+    while (self->hdr->free_entries == 0 || cache_alloc_block(self, cls, &off) != 0) {
+        /* short of a block: evict from this class or a larger one, whose block serves the put by itself */
+        if (cache_evict(self, self->hdr->free_entries == 0 ? 0 : cls) != 0 && cache_evict(self, 0) != 0) {
+            shm_mutex_unlock(&self->hdr->lock);
+            return 1;
+        }
+    }
+    idx = self->hdr->free_entries;
+    e = &self->entries[idx - 1];
+    self->hdr->free_entries = e->next;
+    cache_write_begin(e);
+    memcpy(self->slab + off, key, klen);
+    memcpy(self->slab + off + klen, value, vlen);
+    e->hash = hash;
+    e->off = off;
+    e->klen = (uint32_t) klen;
+    e->vlen = (uint32_t) vlen;
+    e->cls = cls;
+    e->ref = 0;
+    e->next = self->buckets[hash & self->mask];
+    cache_write_end(e);
+    __atomic_store_n(&self->buckets[hash & self->mask], idx, __ATOMIC_RELEASE);
+    ++self->hdr->count;
+    ++self->hdr->in_class[cls];
+    shm_mutex_unlock(&self->hdr->lock);
+    return 0;
+}
+
+static inline int
+cache_delete(cache_t *self, const void *key, size_t klen)
+{
+    /* returns 0 if key was removed, 1 if it was not cached */
+    uint64_t hash;
+    uint32_t idx;
+    assert(self);
+    assert(key || klen == 0);
+    hash = shm_hash_bytes(key, klen);
+    shm_mutex_lock(&self->hdr->lock);
+    idx = cache_lookup_locked(self, key, klen, hash);
+    if (idx != 0)
+        cache_unlink(self, idx);
+    shm_mutex_unlock(&self->hdr->lock);
+    return idx != 0 ? 0 : 1;
+}
+
+#endif //P2PMD_SHM_CACHE_H
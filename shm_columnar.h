@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ */
+
+#ifndef P2PMD_SHM_COLUMNAR_H
+#define P2PMD_SHM_COLUMNAR_H
+
+#include <stdint.h>
+#include <string.h>
+#include "shm_stream.h"
+
+/***************************************************************************************************************\
+|*  Columnar record batches                                                                                    *|
+|***************************************************************************************************************|
+|*  A batch holds nrows rows as one contiguous buffer per column instead of one record per row, so a consumer  *|
+|*  can scan a column with plain vectorisable loops straight out of shared memory. Every buffer starts on a    *|
+|*  COL_ALIGN (64) byte boundary relative to the batch, and batches placed with stream_claim() start on a      *|
+|*  cache line, so the buffers are 64-byte aligned in memory as well.                                          *|
+|*    - fixed-width columns store nrows values;                                                                *|
+|*    - ColBytes columns store nrows + 1 uint32_t offsets and the concatenated values; row i is                *|
+|*      values[offsets[i] .. offsets[i + 1]);                                                                  *|
+|*    - nullable columns add a validity bitmap, bit i (LSB first) set when row i is present.                   *|
+|*                                                                                                             *|
+|*  The producer lays a batch out with col_batch_init() - directly in the stream's data area through           *|
+|*  col_stream_begin() - fills the buffers in place and publishes with col_stream_end(). A consumer peeks the  *|
+|*  record with stream_peek(), validates it once with col_batch_open() and reads the buffers where they are.   *|
+|*  col_batch_open() copies the row count and the column layout into the col_batch_t, and col_bytes() clamps   *|
+|*  every row to its column, so a record the producer overwrites meanwhile yields wrong values but no access   *|
+|*  outside the record; as with any peeked record, stream_valid() tells afterwards whether the bytes were      *|
+|*  still intact.                                                                                              *|
+\***************************************************************************************************************/
+
+/************************************************************\
+|* Columnar batch layout                                    *|
+|************************************************************|
+|* 1) col_batch_header_t                                    *|
+|* 2) col_column_t columns[ncols]                           *|
+|* 3) per column, each COL_ALIGN aligned: validity bitmap   *|
+|*    (nullable only), offsets (ColBytes only), values      *|
+\************************************************************/
+
+#define COL_MAGIC 0x434f4c42u
+#define COL_ALIGN 64
+#define COL_NAME_MAX 24
+#define COL_MAX_COLUMNS 1024
+#define COL_NULLABLE 0x1u
+
+typedef enum _col_type {
+    ColInt32 = 1, ColInt64 = 2, ColFloat32 = 3, ColFloat64 = 4, ColBytes = 5
+} col_type_t;
+
+typedef struct _col_batch_header {
+    uint32_t magic;
+    uint32_t ncols;
+    uint64_t nrows;
+    uint64_t len;
+    uint64_t reserved;
+} col_batch_header_t;
+
+typedef struct _col_column {
+    uint32_t type;
+    uint32_t flags;
+    uint64_t validity_off;      /* 0 when not nullable */
+    uint64_t offsets_off;       /* 0 unless ColBytes */
+    uint64_t values_off;
+    uint64_t values_len;
+    char name[COL_NAME_MAX];
+} col_column_t;
+
+typedef struct _col_spec {
+    const char *name;
+    col_type_t type;
+    unsigned flags;
+    size_t bytes;               /* ColBytes: total value bytes of all rows */
+} col_spec_t;
+
+typedef struct _col_desc {
+    uint32_t type;
+    uint32_t flags;
+    uint64_t validity_off;
+    uint64_t offsets_off;
+    uint64_t values_off;
+    uint64_t values_len;
+} col_desc_t;
+
+typedef struct _col_batch {
+    char *base;
+    col_batch_header_t *hdr;
+    col_column_t *cols;         /* in the batch itself; the accessors only use the private copies below */
+    uint32_t ncols;
+    uint64_t nrows;
+    uint64_t len;
+    col_desc_t desc[COL_MAX_COLUMNS];
+} col_batch_t;
+
+static inline size_t
+col_width(uint32_t type)
+{
+    switch (type) {
+        case ColInt32:
+        case ColFloat32:
+            return 4;
+        case ColInt64:
+        case ColFloat64:
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+static inline uint64_t
+col_align(uint64_t off)
+{
+    return (off + COL_ALIGN - 1) & ~(uint64_t) (COL_ALIGN - 1);
+}
+
+static inline void
+col_set_desc(col_batch_t *batch, uint32_t i, const col_column_t *c)
+{
+    batch->desc[i].type = c->type;
+    batch->desc[i].flags = c->flags;
+    batch->desc[i].validity_off = c->validity_off;
+    batch->desc[i].offsets_off = c->offsets_off;
+    batch->desc[i].values_off = c->values_off;
+    batch->desc[i].values_len = c->values_len;
+}
+
+static inline size_t
+col_batch_size(const col_spec_t *specs, uint32_t ncols, uint64_t nrows)
+{
+    /* bytes col_batch_init() needs for this schema and row count */
+    uint64_t off = col_align(sizeof(col_batch_header_t) + sizeof(col_column_t) * ncols);
+    uint32_t i;
+    for (i = 0; i < ncols; ++i) {
+        if (specs[i].flags & COL_NULLABLE)
+            off = col_align(off + (nrows + 7) / 8);
+        if (specs[i].type == ColBytes)
+            off = col_align(off + sizeof(uint32_t) * (nrows + 1)) + col_align(specs[i].bytes);
+        else
+            off += col_align(col_width(specs[i].type) * nrows);
+    }
+    return (size_t) off;
+}
+
+static inline size_t
+col_batch_init(col_batch_t *batch, void *dst, size_t cap, const col_spec_t *specs, uint32_t ncols, uint64_t nrows)
+{
+    /* Lays the batch out in dst: every row valid, offsets and padding zeroed, values left to the caller. */
+    /* Returns the batch length, 0 if the schema is invalid or the batch does not fit cap bytes. */
+    uint64_t off, bitmap = (nrows + 7) / 8;
+    size_t len;
+    uint32_t i;
+    col_column_t *c;
+    assert(batch);
+    assert(dst);
+    assert(specs || ncols == 0);
+    if (ncols == 0 || ncols > COL_MAX_COLUMNS || ((uintptr_t) dst & (STREAM_ALIGN - 1)) != 0)
+        return 0;
+    for (i = 0; i < ncols; ++i)
+        if ((specs[i].type != ColBytes && col_width(specs[i].type) == 0) || strlen(specs[i].name) >= COL_NAME_MAX
+            || (specs[i].type == ColBytes && specs[i].bytes > UINT32_MAX))
+            return 0;
+    len = col_batch_size(specs, ncols, nrows);
+    if (len > cap)
+        return 0;
+    batch->base = (char *) dst;
+    batch->hdr = (col_batch_header_t *) dst;
+    batch->cols = (col_column_t *) (batch->hdr + 1);
+    memset(dst, 0, col_align(sizeof(col_batch_header_t) + sizeof(col_column_t) * ncols));
+    batch->hdr->magic = COL_MAGIC;
+    batch->hdr->ncols = ncols;
+    batch->hdr->nrows = nrows;
+    batch->hdr->len = len;
+    batch->ncols = ncols;
+    batch->nrows = nrows;
+    batch->len = len;
+    off = col_align(sizeof(col_batch_header_t) + sizeof(col_column_t) * ncols);
+    for (i = 0; i < ncols; ++i) {
+        c = &batch->cols[i];
+        c->type = specs[i].type;
+        c->flags = specs[i].flags & COL_NULLABLE;
+        strcpy(c->name, specs[i].name);
+        if (c->flags & COL_NULLABLE) {
+            c->validity_off = off;
+            memset(batch->base + off, 0, (size_t) (col_align(off + bitmap) - off));
+            memset(batch->base + off, 0xff, (size_t) bitmap);
+            off = col_align(off + bitmap);
+        }
+        if (c->type == ColBytes) {
+            c->offsets_off = off;
+            memset(batch->base + off, 0, (size_t) (col_align(off + sizeof(uint32_t) * (nrows + 1)) - off));
+            off = col_align(off + sizeof(uint32_t) * (nrows + 1));
+            c->values_len = specs[i].bytes;
+        } else
+            c->values_len = col_width(c->type) * nrows;
+        c->values_off = off;
+        off += col_align(c->values_len);
+        col_set_desc(batch, i, c);
+    }
+    return len;
+}
+
+static inline int
+col_batch_open(col_batch_t *batch, const void *data, size_t len)
+{
+    /* Validates a received batch and copies its layout into batch, so that the accessors below stay inside */
+    /* the record even if the producer overwrites it; stream_valid() still tells whether the values were. */
+    col_batch_header_t hdr;
+    col_column_t c;
+    const uint32_t *offsets;
+    uint64_t end, bitmap;
+    uint32_t i;
+    assert(batch);
+    if (data == NULL || len < sizeof(col_batch_header_t) || ((uintptr_t) data & (STREAM_ALIGN - 1)) != 0)
+        return 1;
+    memcpy(&hdr, data, sizeof(hdr));
+    if (hdr.magic != COL_MAGIC || hdr.ncols == 0 || hdr.ncols > COL_MAX_COLUMNS || hdr.len != len
+        || sizeof(col_batch_header_t) + sizeof(col_column_t) * hdr.ncols > len || hdr.nrows > len * 8)
+        return 1;
+    bitmap = (hdr.nrows + 7) / 8;
+    for (i = 0; i < hdr.ncols; ++i) {
+        memcpy(&c, (const col_column_t *) ((const col_batch_header_t *) data + 1) + i, sizeof(c));
+        if (memchr(c.name, '\0', COL_NAME_MAX) == NULL || c.values_off % COL_ALIGN != 0
+            || c.values_off > len || c.values_len > len - c.values_off)
+            return 1;
+        if ((c.flags & COL_NULLABLE) && (c.validity_off % COL_ALIGN != 0 || c.validity_off > len
+                                         || bitmap > len - c.validity_off))
+            return 1;
+        if (c.type == ColBytes) {
+            end = c.offsets_off + sizeof(uint32_t) * (hdr.nrows + 1);
+            if (c.offsets_off % COL_ALIGN != 0 || c.offsets_off > len || end > len || end < c.offsets_off)
+                return 1;
+            offsets = (const uint32_t *) ((const char *) data + c.offsets_off);
+            for (end = 0; end < hdr.nrows; ++end)
+                if (offsets[end] > offsets[end + 1])
+                    return 1;
+            if (offsets[hdr.nrows] > c.values_len)
+                return 1;
+        } else if (col_width(c.type) == 0 || c.values_len != col_width(c.type) * hdr.nrows)
+            return 1;
+        col_set_desc(batch, i, &c);
+    }
+    batch->base = (char *) data;
+    batch->hdr = (col_batch_header_t *) data;
+    batch->cols = (col_column_t *) (batch->hdr + 1);
+    batch->ncols = hdr.ncols;
+    batch->nrows = hdr.nrows;
+    batch->len = len;
+    return 0;
+}
+
+static inline int
+col_find(const col_batch_t *batch, const char *name)
+{
+    /* returns the index of the named column, -1 if there is none */
+    uint32_t i;
+    for (i = 0; i < batch->ncols; ++i)
+        if (strncmp(batch->cols[i].name, name, COL_NAME_MAX) == 0)
+            return (int) i;
+    return -1;
+}
+
+static inline void *
+col_values(const col_batch_t *batch, uint32_t col)
+{
+    assert(col < batch->ncols);
+    return batch->base + batch->desc[col].values_off;
+}
+
+static inline uint32_t *
+col_offsets(const col_batch_t *batch, uint32_t col)
+{
+    /* ColBytes only: nrows + 1 entries, offsets[0] == 0; a consumer should read rows through col_bytes() */
+    assert(col < batch->ncols && batch->desc[col].type == ColBytes);
+    return (uint32_t *) (batch->base + batch->desc[col].offsets_off);
+}
+
+static inline uint8_t *
+col_validity(const col_batch_t *batch, uint32_t col)
+{
+    /* NULL for columns that are not nullable */
+    assert(col < batch->ncols);
+    if (!(batch->desc[col].flags & COL_NULLABLE))
+        return NULL;
+    return (uint8_t *) (batch->base + batch->desc[col].validity_off);
+}
+
+static inline int
+col_is_valid(const col_batch_t *batch, uint32_t col, uint64_t row)
+{
+    const uint8_t *bits = col_validity(batch, col);
+    assert(row < batch->nrows);
+    return bits == NULL || (bits[row / 8] >> (row % 8)) & 1;
+}
+
+static inline void
+col_set_null(col_batch_t *batch, uint32_t col, uint64_t row)
+{
+    uint8_t *bits = col_validity(batch, col);
+    assert(bits);
+    assert(row < batch->nrows);
+    bits[row / 8] &= (uint8_t) ~(1u << (row % 8));
+}
+
+static inline const char *
+col_bytes(const col_batch_t *batch, uint32_t col, uint64_t row, size_t *len)
+{
+    /* ColBytes only: row's value and its length, clamped to the column's values if the record was overwritten */
+    const uint32_t *offsets = col_offsets(batch, col);
+    uint64_t lo, hi, vlen = batch->desc[col].values_len;
+    assert(row < batch->nrows);
+    lo = __atomic_load_n(&offsets[row], __ATOMIC_RELAXED);
+    hi = __atomic_load_n(&offsets[row + 1], __ATOMIC_RELAXED);
+    hi = hi < vlen ? hi : vlen;
+    lo = lo < hi ? lo : hi;
+    *len = (size_t) (hi - lo);
+    return (const char *) col_values(batch, col) + lo;
+}
+
+static inline int
+col_stream_begin(stream_t *stream, col_batch_t *batch, const col_spec_t *specs, uint32_t ncols, uint64_t nrows)
+{
+    /* lays a batch out directly in the stream's data area; fill it, then col_stream_end() */
+    size_t len = col_batch_size(specs, ncols, nrows);
+    void *dst = stream_claim(stream, len);
+    if (dst == NULL)
+        return 1;
+    return col_batch_init(batch, dst, len, specs, ncols, nrows) == 0 ? 1 : 0;
+}
+
+static inline void
+col_stream_end(stream_t *stream, col_batch_t *batch, uint64_t *offset)
+{
+    stream_publish(stream, (size_t) batch->len, offset);
+}
+
+#endif //P2PMD_SHM_COLUMNAR_H
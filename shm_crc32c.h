@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ */
+
+#ifndef P2PMD_SHM_CRC32C_H
+#define P2PMD_SHM_CRC32C_H
+
+#include <stdint.h>
+#include <string.h>
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+/***************************************************************************************************************\
+|*  CRC32C (Castagnoli) with an optional fused copy                                                            *|
+|***************************************************************************************************************|
+|*  crc32c_copy(dst, src, len, crc) copies len bytes and returns the CRC of the copied bytes, touching the     *|
+|*  data once. On x86-64 with SSE4.2 (checked at runtime) and on ARMv8 built with +crc it uses the CRC32       *|
+|*  instructions; elsewhere a table-driven fallback. The instruction has a 3-cycle latency but 1-cycle        *|
+|*  throughput, so the hardware path runs three independent lanes over adjacent blocks and merges them with    *|
+|*  precomputed "append N zero bytes" operators (the method of Mark Adler's crc32c.c), which keeps it close    *|
+|*  to memcpy speed. `crc` is the CRC of any preceding data (0 to start), so calls can be chained.             *|
+\***************************************************************************************************************/
+
+#define CRC32C_POLY 0x82f63b78u
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+typedef struct _crc32c_tables {
+    volatile int ready;
+    uint32_t byte[256];
+    uint32_t lng[4][256];
+    uint32_t shrt[4][256];
+} crc32c_tables_t;
+
+static crc32c_tables_t crc32c_tab;
+
+static inline uint32_t
+crc32c_gf2_times(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+    while (vec) {
+        if (vec & 1)
+            sum ^= *mat;
+        vec >>= 1;
+        ++mat;
+    }
+    return sum;
+}
+
+static inline void
+crc32c_gf2_square(uint32_t *square, const uint32_t *mat)
+{
+    int n;
+    for (n = 0; n < 32; ++n)
+        square[n] = crc32c_gf2_times(mat, mat[n]);
+}
+
+static inline void
+crc32c_zeros(uint32_t zeros[][256], size_t len)
+{
+    /* operator appending len (a power of two) zero bytes to a raw CRC, split into per-byte tables */
+    uint32_t even[32], odd[32], row = 1;
+    int n;
+    odd[0] = CRC32C_POLY;
+    for (n = 1; n < 32; ++n) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    crc32c_gf2_square(even, odd);
+    crc32c_gf2_square(odd, even);
+    for (;;) {
+        crc32c_gf2_square(even, odd);
+        len >>= 1;
+        if (len == 0)
+            break;
+        crc32c_gf2_square(odd, even);
+        len >>= 1;
+        if (len == 0) {
+            memcpy(even, odd, sizeof(even));
+            break;
+        }
+    }
+    for (n = 0; n < 256; ++n) {
+        zeros[0][n] = crc32c_gf2_times(even, (uint32_t) n);
+        zeros[1][n] = crc32c_gf2_times(even, (uint32_t) n << 8);
+        zeros[2][n] = crc32c_gf2_times(even, (uint32_t) n << 16);
+        zeros[3][n] = crc32c_gf2_times(even, (uint32_t) n << 24);
+    }
+}
+
+static inline void
+crc32c_init(void)
+{
+    uint32_t n, k, c;
+    if (__atomic_load_n(&crc32c_tab.ready, __ATOMIC_ACQUIRE))
+        return;
+    for (n = 0; n < 256; ++n) {
+        c = n;
+        for (k = 0; k < 8; ++k)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc32c_tab.byte[n] = c;
+    }
+    crc32c_zeros(crc32c_tab.lng, CRC32C_LONG);
+    crc32c_zeros(crc32c_tab.shrt, CRC32C_SHORT);
+    __atomic_store_n(&crc32c_tab.ready, 1, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t
+crc32c_shift(uint32_t zeros[][256], uint32_t crc)
+{
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^ zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static inline uint32_t
+crc32c_copy_sw(void *dst, const void *src, size_t len, uint32_t crc)
+{
+    const unsigned char *s = (const unsigned char *) src;
+    size_t i;
+    if (dst)
+        memcpy(dst, src, len);
+    crc = ~crc;
+    for (i = 0; i < len; ++i)
+        crc = crc32c_tab.byte[(crc ^ s[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#if defined(__x86_64__) || (defined(__aarch64__) && defined(__ARM_FEATURE_CRC32))
+#define CRC32C_HAVE_HW 1
+#if defined(__x86_64__)
+#define CRC32C_TARGET __attribute__((target("sse4.2")))
+#define CRC32C_U64(crc, v) ((uint32_t) __builtin_ia32_crc32di((crc), (v)))
+#define CRC32C_U8(crc, v) __builtin_ia32_crc32qi((crc), (v))
+#else
+#define CRC32C_TARGET
+#define CRC32C_U64(crc, v) __crc32cd((crc), (v))
+#define CRC32C_U8(crc, v) __crc32cb((crc), (v))
+#endif
+
+#define CRC32C_STEP(lane, off)                      \
+    do {                                            \
+        uint64_t _v;                                \
+        memcpy(&_v, s + (off), 8);                  \
+        if (d)                                      \
+            memcpy(d + (off), &_v, 8);              \
+        lane = CRC32C_U64(lane, _v);                \
+    } while (0)
+
+static CRC32C_TARGET uint32_t
+crc32c_copy_hw(void *dst, const void *src, size_t len, uint32_t crc)
+{
+    const unsigned char *s = (const unsigned char *) src;
+    unsigned char *d = (unsigned char *) dst;
+    uint64_t crc0 = ~crc, crc1, crc2;
+    size_t i, block;
+    while (len && ((uintptr_t) s & 7)) {
+        if (d)
+            *d++ = *s;
+        crc0 = CRC32C_U8((uint32_t) crc0, *s++);
+        --len;
+    }
+    for (block = CRC32C_LONG; block >= CRC32C_SHORT; block = CRC32C_SHORT) {
+        while (len >= block * 3) {
+            crc1 = crc2 = 0;
+            for (i = 0; i < block; i += 8) {
+                CRC32C_STEP(crc0, i);
+                CRC32C_STEP(crc1, i + block);
+                CRC32C_STEP(crc2, i + 2 * block);
+            }
+            if (block == CRC32C_LONG) {
+                crc0 = crc32c_shift(crc32c_tab.lng, (uint32_t) crc0) ^ crc1;
+                crc0 = crc32c_shift(crc32c_tab.lng, (uint32_t) crc0) ^ crc2;
+            } else {
+                crc0 = crc32c_shift(crc32c_tab.shrt, (uint32_t) crc0) ^ crc1;
+                crc0 = crc32c_shift(crc32c_tab.shrt, (uint32_t) crc0) ^ crc2;
+            }
+            s += 3 * block;
+            if (d)
+                d += 3 * block;
+            len -= 3 * block;
+        }
+        if (block == CRC32C_SHORT)
+            break;
+    }
+    for (i = 0; i + 8 <= len; i += 8)
+        CRC32C_STEP(crc0, i);
+    s += i;
+    if (d)
+        d += i;
+    len -= i;
+    while (len--) {
+        if (d)
+            *d++ = *s;
+        crc0 = CRC32C_U8((uint32_t) crc0, *s++);
+    }
+    return ~(uint32_t) crc0;
+}
+
+#undef CRC32C_STEP
+#endif
+
+static inline int
+crc32c_hw_available(void)
+{
+#if defined(__x86_64__)
+    return __builtin_cpu_supports("sse4.2");
+#elif defined(CRC32C_HAVE_HW)
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static inline uint32_t
+crc32c_copy(void *dst, const void *src, size_t len, uint32_t crc)
+{
+    /* dst may be NULL to only checksum src */
+    crc32c_init();
+#ifdef CRC32C_HAVE_HW
+    if (crc32c_hw_available())
+        return crc32c_copy_hw(dst, src, len, crc);
+#endif
+    return crc32c_copy_sw(dst, src, len, crc);
+}
+
+static inline uint32_t
+crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    return crc32c_copy(NULL, buf, len, crc);
+}
+
+#endif //P2PMD_SHM_CRC32C_H
@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ */
+
+#ifndef P2PMD_SHM_DELTA_H
+#define P2PMD_SHM_DELTA_H
+
+#include <stdint.h>
+#include "shared_memory.h"
+
+/***************************************************************************************************************\
+|*  Delta mode for shared_memory_t channels                                                                    *|
+|***************************************************************************************************************|
+|*  Instead of chunks, the segment keeps the last message sent (the base) after a range table. The producer   *|
+|*  compares the new message against the base block by block, copies only the blocks that changed into the    *|
+|*  base and lists them in the range table; the consumer copies only those ranges into its own copy of the     *|
+|*  previous message, reconstructing the new one in place. The same (R,W) handshake as send_item/recv_item    *|
+|*  protects the segment, so the base is stable while the consumer reads it.                                   *|
+|*                                                                                                             *|
+|*  A full copy is sent (DELTA_FULL) for the first message, on a length change, or when the ranges would      *|
+|*  not fit the table or cover more than half the message. A consumer whose sequence number does not          *|
+|*  immediately precede the message's (it attached late or lost a message) also copies the whole base, so it  *|
+|*  never applies a delta to the wrong base. A channel is either in delta mode or in chunk mode, never both.  *|
+\***************************************************************************************************************/
+
+/************************************************************\
+|* Delta segment layout                                     *|
+|************************************************************|
+|* 1) delta_header_t                                        *|
+|* 2) delta_range_t ranges[DELTA_MAX_RANGES]                *|
+|* 3) base message at DELTA_BASE_OFFSET                     *|
+\************************************************************/
+
+#define DELTA_BLOCK 64
+#define DELTA_MERGE_GAP 256
+#define DELTA_MAX_RANGES 4096
+#define DELTA_FULL 0x1u
+
+typedef struct _delta_header {
+    uint64_t seq;
+    uint64_t len;
+    uint32_t nranges;
+    uint32_t flags;
+} delta_header_t;
+
+typedef struct _delta_range {
+    uint32_t off;
+    uint32_t len;
+} delta_range_t;
+
+typedef struct _delta_state {
+    uint64_t seq;               /* last message applied by this consumer, 0 before the first */
+    size_t last_copied;         /* payload bytes the last send_delta/recv_delta copied */
+} delta_state_t;
+
+#define DELTA_BASE_OFFSET ((sizeof(delta_header_t) + sizeof(delta_range_t) * DELTA_MAX_RANGES + 63) & ~(size_t) 63)
+#define DELTA_MAX_LEN (CHANNEL_CONTROL_OFFSET - DELTA_BASE_OFFSET)
+
+static inline int
+send_delta(shared_memory_t *self, const void *data, size_t len, delta_state_t *state)
+{
+    /* Precondition: (R,W) = (0,1); Postcondition: (R,W) = (1,0). state may be NULL */
+    delta_header_t *hdr;
+    delta_range_t *ranges;
+    char *base;
+    const char *src = (const char *) data;
+    size_t off, copied = 0, end = 0;
+    uint32_t n = 0;
+    int full;
+    assert(self);
+    assert(data);
+    if (len == 0 || len > DELTA_MAX_LEN)
+        return 1;
+    hdr = (delta_header_t *) self->data;
+    ranges = (delta_range_t *) (hdr + 1);
+    base = (char *) self->data + DELTA_BASE_OFFSET;
+    if (channel_acquire(self, self->w_sem, ChannelWriting) != 0)
+        return 1;
+    full = hdr->seq == 0 || hdr->len != len;
+    for (off = 0; !full && off < len; off += DELTA_BLOCK) {
+        size_t blk = len - off < DELTA_BLOCK ? len - off : DELTA_BLOCK;
+        if (memcmp(base + off, src + off, blk) == 0)
+            continue;
+        memcpy(base + off, src + off, blk);
+        copied += blk;
+        if (n > 0 && off - end <= DELTA_MERGE_GAP) {
+            /* the unchanged gap is cheaper to re-copy than a new range */
+            ranges[n - 1].len = (uint32_t) (off + blk - ranges[n - 1].off);
+        } else if (n < DELTA_MAX_RANGES) {
+            ranges[n].off = (uint32_t) off;
+            ranges[n].len = (uint32_t) blk;
+            ++n;
+        } else
+            full = 1;
+        end = off + blk;
+        if (copied > len / 2)
+            full = 1;
+    }
+    if (full) {
+        memcpy(base, src, len);
+        copied = len;
+        n = 0;
+    }
+    hdr->len = len;
+    hdr->nranges = n;
+    hdr->flags = full ? DELTA_FULL : 0;
+    ++hdr->seq;
+    if (state) {
+        state->seq = hdr->seq;
+        state->last_copied = copied;
+    }
+    channel_release(self, self->r_sem);
+    return 0;
+}
+
+static inline int
+recv_delta(shared_memory_t *self, delta_state_t *state, void *buf, size_t cap, size_t *len)
+{
+    /* Precondition: buf holds the message previously received through state (or anything if state->seq == 0) */
+    /* Postcondition: buf holds the new message, *len its length */
+    delta_header_t *hdr;
+    delta_range_t *ranges;
+    const char *base;
+    char *dst = (char *) buf;
+    uint32_t i;
+    int rt = 0;
+    assert(self);
+    assert(state);
+    assert(buf);
+    assert(len);
+    hdr = (delta_header_t *) self->data;
+    ranges = (delta_range_t *) (hdr + 1);
+    base = (const char *) self->data + DELTA_BASE_OFFSET;
+    if (channel_acquire(self, self->r_sem, ChannelReading) != 0) {
+        state->seq = 0;
+        return 1;
+    }
+    *len = hdr->len;
+    if (hdr->len == 0 || hdr->len > DELTA_MAX_LEN || hdr->len > cap || hdr->nranges > DELTA_MAX_RANGES) {
+        SHM_TRACE(TraceBadChunk, hdr->seq, hdr->len);
+        rt = 1;
+    } else if ((hdr->flags & DELTA_FULL) || state->seq + 1 != hdr->seq) {
+        memcpy(dst, base, hdr->len);
+        state->last_copied = hdr->len;
+    } else {
+        state->last_copied = 0;
+        for (i = 0; i < hdr->nranges; ++i) {
+            if ((uint64_t) ranges[i].off + ranges[i].len > hdr->len) {
+                SHM_TRACE(TraceBadChunk, hdr->seq, i);
+                rt = 1;
+                break;
+            }
+            memcpy(dst + ranges[i].off, base + ranges[i].off, ranges[i].len);
+            state->last_copied += ranges[i].len;
+        }
+    }
+    state->seq = rt ? 0 : hdr->seq;
+    channel_release(self, self->w_sem);
+    return rt;
+}
+
+#endif //P2PMD_SHM_DELTA_H
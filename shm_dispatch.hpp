@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ */
+
+#ifndef P2PMD_SHM_DISPATCH_HPP
+#define P2PMD_SHM_DISPATCH_HPP
+
+#include <array>
+#include <cstdlib>
+#include <type_traits>
+#include <utility>
+#include "shm_schema.hpp"
+
+/***************************************************************************************************************\
+|*  Typed channels with compile-time dispatch (C++17)                                                          *|
+|***************************************************************************************************************|
+|*  shm::message_types<A, B, C> lists the message types a channel carries; a type's id is its index in the     *|
+|*  list. A type is either a trivially copyable struct, delivered as const T &, or a shm::schema, delivered    *|
+|*  as a shm::view over the message (see shm_schema.hpp). Every message starts with a shm::type_tag.           *|
+|*                                                                                                             *|
+|*  shm::dispatch() reads the tag where the message lies and calls through a constexpr table with one entry    *|
+|*  per type, generated for the handler: no switch on the tag and no copy of a header out of the message. The  *|
+|*  handler is any callable that accepts every type in the list, e.g. shm::overloaded{lambdas...}. Messages    *|
+|*  with an unknown id, a tag from a different type list or the wrong size are rejected. The list's            *|
+|*  fingerprint hashes the name of every type in list order, as the compiler spells it, so reordering or       *|
+|*  renaming types changes it, and both ends must be built with the same compiler.                             *|
+|*                                                                                                             *|
+|*  shm::typed_channel wraps a shared_memory_t: send() for structs, build()/send() for schema messages and     *|
+|*  recv(handler), which dispatches the received item and frees it. Both ends must use the same type list.     *|
+\***************************************************************************************************************/
+
+/************************************************************\
+|* Typed message layout                                     *|
+|************************************************************|
+|* 1) shm::type_tag {id, list}                              *|
+|* 2) the struct, or the schema message                     *|
+\************************************************************/
+
+namespace shm {
+
+struct type_tag {
+    uint32_t id;
+    uint32_t list;              /* fingerprint of the type list */
+};
+
+template <typename T>
+struct is_schema : std::false_type {};
+
+template <typename... F>
+struct is_schema<schema<F...>> : std::true_type {};
+
+template <typename... Fs>
+struct overloaded : Fs ... {
+    using Fs::operator()...;
+};
+
+template <typename... Fs>
+overloaded(Fs...) -> overloaded<Fs...>;
+
+template <typename T>
+constexpr uint32_t
+type_fingerprint()
+{
+    /* FNV-1a over the compiler's spelling of T, which names the type, so equal-sized types differ */
+    const char *name = __PRETTY_FUNCTION__;
+    uint32_t h = 2166136261u;
+    for (; *name != '\0'; ++name) {
+        h ^= static_cast<unsigned char>(*name);
+        h *= 16777619u;
+    }
+    if constexpr (is_schema<T>::value)
+        h ^= T::fingerprint;
+    return (h ^ static_cast<uint32_t>(sizeof(T))) * 16777619u;
+}
+
+template <typename... Ts>
+struct message_types {
+    static constexpr size_t count = sizeof...(Ts);
+    static_assert(count > 0, "a type list needs at least one type");
+
+    template <typename T>
+    static constexpr size_t
+    occurrences()
+    {
+        return (static_cast<size_t>(std::is_same<T, Ts>::value) + ...);
+    }
+
+    static_assert(((occurrences<Ts>() == 1) && ...), "every message type may appear once");
+    static_assert(((is_schema<Ts>::value || (std::is_trivially_copyable<Ts>::value
+                                             && alignof(Ts) <= sizeof(type_tag))) && ...),
+                  "message types are schemas or trivially copyable structs aligned to at most 8 bytes");
+
+    template <typename T>
+    static constexpr uint32_t
+    id_of()
+    {
+        static_assert(occurrences<T>() == 1, "type is not in this list");
+        uint32_t i = 0, id = 0;
+        ((std::is_same<T, Ts>::value ? (id = i, ++i) : ++i), ...);
+        return id;
+    }
+
+    static constexpr uint32_t
+    compute_fingerprint()
+    {
+        /* FNV-1a over the per-type fingerprints, in list order */
+        const uint32_t words[] = {type_fingerprint<Ts>()...};
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < count; ++i) {
+            h ^= words[i];
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    static constexpr uint32_t fingerprint = compute_fingerprint();
+};
+
+template <typename T, typename H>
+int
+dispatch_one(const char *payload, size_t len, H &handler)
+{
+    if constexpr (is_schema<T>::value) {
+        view<T> v;
+        if (!v.open(payload, len))
+            return 1;
+        handler(v);
+    } else {
+        if (len != sizeof(T))
+            return 1;
+        handler(*reinterpret_cast<const T *>(payload));
+    }
+    return 0;
+}
+
+template <typename L, typename H>
+struct dispatch_table;
+
+template <typename... Ts, typename H>
+struct dispatch_table<message_types<Ts...>, H> {
+    using entry = int (*)(const char *, size_t, H &);
+    static constexpr std::array<entry, sizeof...(Ts)> table = {&dispatch_one<Ts, H>...};
+};
+
+template <typename L, typename H>
+inline int
+dispatch(const void *data, size_t len, H &&handler)
+{
+    /* calls handler with the message in data, which must be 8-byte aligned; 1 if it is not a valid message */
+    using table = dispatch_table<L, std::remove_reference_t<H>>;
+    type_tag tag;
+    if (data == nullptr || len < sizeof(type_tag) || reinterpret_cast<uintptr_t>(data) % sizeof(type_tag) != 0)
+        return 1;
+    std::memcpy(&tag, data, sizeof(tag));
+    if (tag.list != L::fingerprint || tag.id >= L::count)
+        return 1;
+    return table::table[tag.id](static_cast<const char *>(data) + sizeof(type_tag), len - sizeof(type_tag),
+                                handler);
+}
+
+template <typename L, typename T>
+inline size_t
+encode(void *dst, size_t cap, const T &msg)
+{
+    /* writes a tagged struct message to dst, e.g. space from stream_claim(); returns its length, 0 if too small */
+    static_assert(!is_schema<T>::value, "use typed_channel::build() for schema messages");
+    type_tag tag = {L::template id_of<T>(), L::fingerprint};
+    if (dst == nullptr || cap < sizeof(tag) + sizeof(T))
+        return 0;
+    std::memcpy(dst, &tag, sizeof(tag));
+    std::memcpy(static_cast<char *>(dst) + sizeof(tag), &msg, sizeof(T));
+    return sizeof(tag) + sizeof(T);
+}
+
+template <typename L>
+class typed_channel {
+public:
+    explicit typed_channel(shared_memory_t *shm) : shm_(shm) {}
+
+    template <typename T>
+    int
+    send(const T &msg)
+    {
+        alignas(8) char buf[sizeof(type_tag) + sizeof(T)];
+        encode<L>(buf, sizeof(buf), msg);
+        return send_item(shm_, buf, sizeof(buf));
+    }
+
+    template <typename S>
+    builder<S>
+    build(void *buf, size_t cap)
+    {
+        /* a builder for a schema message in buf (8-byte aligned), tagged for this channel; send it with send() */
+        type_tag tag = {L::template id_of<S>(), L::fingerprint};
+        if (buf == nullptr || cap < sizeof(tag))
+            return builder<S>(nullptr, 0);
+        std::memcpy(buf, &tag, sizeof(tag));
+        return builder<S>(static_cast<char *>(buf) + sizeof(tag), cap - sizeof(tag));
+    }
+
+    template <typename S>
+    int
+    send(builder<S> &b)
+    {
+        size_t len = b.finish();
+        return len == 0 ? 1 : send_item(shm_, b.data() - sizeof(type_tag), sizeof(type_tag) + len);
+    }
+
+    template <typename H>
+    int
+    recv(H &&handler)
+    {
+        /* receives one item and dispatches it; 1 if nothing was received or the item was rejected */
+        void *data;
+        size_t len;
+        int rt;
+        if (recv_item(shm_, &data, &len) != 0)
+            return 1;
+        rt = dispatch<L>(data, len, std::forward<H>(handler));
+        free(data);
+        return rt;
+    }
+
+private:
+    shared_memory_t *shm_;
+};
+
+} // namespace shm
+
+#endif //P2PMD_SHM_DISPATCH_HPP
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ */
+
+#ifndef P2PMD_SHM_HASH_H
+#define P2PMD_SHM_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "shm_wait.h"
+
+/***************************************************************************************************************\
+|*  Helpers shared by the open-addressed tables                                                                *|
+|***************************************************************************************************************|
+|*  shm_hash_mix() is the MurmurHash3 64-bit finalizer: every input bit affects every output bit, so the low   *|
+|*  bits of the result can index a power-of-two table directly. shm_hash_bytes() is FNV-1a over the bytes,     *|
+|*  finished with shm_hash_mix(); it is meant for short keys such as symbols and cache keys. Both are stable   *|
+|*  across processes and builds, so hashes may be stored in shared segments.                                   *|
+|*                                                                                                             *|
+|*  shm_slot_wait_ready() waits for a slot another process has claimed (Writing) to be published. The writer   *|
+|*  holds the slot for a few copies only, so it spins, but gives up after SHM_SLOT_WAIT_NS: a slot still       *|
+|*  Writing by then belongs to a writer that died and will never be published.                                 *|
+\***************************************************************************************************************/
+
+#define SHM_SLOT_WAIT_NS 100000000ull
+
+static inline uint64_t
+shm_hash_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint64_t
+shm_hash_bytes(const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    uint64_t h = 0xcbf29ce484222325ull;
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3ull;
+    }
+    return shm_hash_mix(h);
+}
+
+static inline int
+shm_slot_wait_ready(const volatile uint32_t *state, uint32_t writing)
+{
+    /* 0 once *state is no longer `writing`, 1 if it still is after SHM_SLOT_WAIT_NS */
+    uint64_t now, deadline = 0;
+    uint32_t spins = 0;
+    while (__atomic_load_n(state, __ATOMIC_ACQUIRE) == writing) {
+        cpu_relax();
+        if ((++spins & 1023) == 0) {
+            now = monotonic_ns();
+            if (deadline == 0)
+                deadline = now + SHM_SLOT_WAIT_NS;
+            else if (now >= deadline)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+#endif //P2PMD_SHM_HASH_H
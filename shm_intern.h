@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ */
+
+#ifndef P2PMD_SHM_INTERN_H
+#define P2PMD_SHM_INTERN_H
+
+#include <stdint.h>
+#include <string.h>
+#include "shm_segment.h"
+#include "shm_wait.h"
+#include "shm_hash.h"
+
+/***************************************************************************************************************\
+|*  Shared string interning                                                                                    *|
+|***************************************************************************************************************|
+|*  A segment that maps strings to dense 32-bit ids and back. intern() returns the id of a string, storing it  *|
+|*  the first time any process interns it; intern_str() turns an id back into the stored, NUL-terminated       *|
+|*  bytes in O(1). Producers put ids in their messages instead of symbol and key strings, and consumers        *|
+|*  compare ids as integers. Ids start at 1 (INTERN_NONE is 0), stay valid for the life of the segment and     *|
+|*  are never reused; size the table for every distinct string that will ever be interned.                     *|
+|*                                                                                                             *|
+|*  The index works like the blob store's: slots go Empty -> Writing (claimed by CAS) -> Ready (published      *|
+|*  with release), and a process probing into a Writing slot waits for it before comparing, so two processes   *|
+|*  interning the same string at once get the same id. Lookups by id only read the id directory. A string      *|
+|*  that no longer fits the arena or the id space leaves a dead slot behind and intern() fails. A process      *|
+|*  that dies between claiming a slot and publishing it leaves the slot Writing for good; lookups that probe   *|
+|*  into it give up after SHM_SLOT_WAIT_NS and fail, so strings that hash onto that probe chain can no longer  *|
+|*  be interned or found.                                                                                      *|
+\***************************************************************************************************************/
+
+/************************************************************\
+|* Intern table layout                                      *|
+|************************************************************|
+|* 1) intern_header_t                                       *|
+|* 2) intern_slot_t slots[nslots]                           *|
+|* 3) uint64_t dir[nslots]: arena offset of id, 0 if unset  *|
+|* 4) arena: per string uint32_t len, bytes, '\0'           *|
+\************************************************************/
+
+#define INTERN_MAGIC 0x494e544eu
+#define INTERN_NONE 0
+#define INTERN_ALIGN 8
+#define INTERN_MAX_LEN 0xffffffffu
+
+typedef enum _intern_state {
+    InternEmpty = 0, InternWriting = 1, InternReady = 2
+} intern_state_t;
+
+typedef struct _intern_slot {
+    volatile uint32_t state;
+    uint32_t id;                /* INTERN_NONE for a dead slot */
+    uint64_t hash;
+} intern_slot_t;
+
+typedef struct _intern_header {
+    volatile uint32_t magic;
+    uint32_t nslots;
+    uint64_t arena_size;
+    volatile uint64_t arena_used;
+    volatile uint32_t next_id;
+    uint32_t pad;
+} intern_header_t;
+
+typedef struct _intern_table {
+    shared_segment_t segment;
+    intern_header_t *hdr;
+    intern_slot_t *slots;
+    volatile uint64_t *dir;
+    char *arena;
+    uint32_t mask;
+} intern_table_t;
+
+static inline void
+intern_bind(intern_table_t *self)
+{
+    self->slots = (intern_slot_t *) (self->hdr + 1);
+    self->dir = (volatile uint64_t *) (self->slots + self->hdr->nslots);
+    self->arena = (char *) (self->dir + self->hdr->nslots);
+    self->mask = self->hdr->nslots - 1;
+}
+
+static inline int
+create_intern_table(intern_table_t *self, const char *name, uint32_t nslots, size_t arena_size)
+{
+    /* precondition: nslots is a power of two; at most nslots - 1 strings can be interned */
+    size_t size;
+    assert(self);
+    assert(name);
+    assert(nslots > 1 && (nslots & (nslots - 1)) == 0);
+    size = sizeof(intern_header_t) + (sizeof(intern_slot_t) + sizeof(uint64_t)) * nslots + arena_size;
+    if (map_shared_segment(&self->segment, name, size) != 0)
+        return 1;
+    memset(self->segment.data, 0, size - arena_size);
+    self->hdr = (intern_header_t *) self->segment.data;
+    self->hdr->nslots = nslots;
+    self->hdr->arena_size = arena_size;
+    /* arena offset 0 marks an unpublished id, so strings start one alignment unit in */
+    self->hdr->arena_used = INTERN_ALIGN;
+    self->hdr->next_id = 1;
+    intern_bind(self);
+    __atomic_store_n(&self->hdr->magic, INTERN_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static inline int
+open_intern_table(intern_table_t *self, const char *name)
+{
+    assert(self);
+    assert(name);
+    if (attach_shared_segment(&self->segment, name) != 0)
+        return 1;
+    self->hdr = (intern_header_t *) self->segment.data;
+    if (__atomic_load_n(&self->hdr->magic, __ATOMIC_ACQUIRE) != INTERN_MAGIC
+        || sizeof(intern_header_t) + (sizeof(intern_slot_t) + sizeof(uint64_t)) * (size_t) self->hdr->nslots
+           + self->hdr->arena_size > self->segment.size) {
+        detach_shared_segment(&self->segment);
+        return 1;
+    }
+    intern_bind(self);
+    return 0;
+}
+
+static inline void
+detach_intern_table(intern_table_t *self)
+{
+    assert(self);
+    detach_shared_segment(&self->segment);
+}
+
+static inline void
+close_intern_table(const char *name)
+{
+    assert(name);
+    shm_unlink(name);
+}
+
+static inline const char *
+intern_str(const intern_table_t *self, uint32_t id, size_t *len)
+{
+    /* the string with this id, NUL-terminated and valid while the table is mapped; NULL for an unknown id */
+    uint64_t off;
+    uint32_t n;
+    assert(self);
+    if (id == INTERN_NONE || id >= self->hdr->nslots)
+        return NULL;
+    off = __atomic_load_n(&self->dir[id], __ATOMIC_ACQUIRE);
+    if (off == 0 || off + sizeof(uint32_t) > self->hdr->arena_size)
+        return NULL;
+    memcpy(&n, self->arena + off, sizeof(uint32_t));
+    if (len)
+        *len = n;
+    return self->arena + off + sizeof(uint32_t);
+}
+
+static inline int
+intern_matches(const intern_table_t *self, const intern_slot_t *slot, uint64_t hash, const char *str, size_t len)
+{
+    size_t n;
+    const char *stored;
+    if (slot->hash != hash || slot->id == INTERN_NONE)
+        return 0;
+    stored = intern_str(self, slot->id, &n);
+    return stored != NULL && n == len && memcmp(stored, str, len) == 0;
+}
+
+static inline int
+intern_find(const intern_table_t *self, const char *str, size_t len, uint32_t *id)
+{
+    /* looks a string up without interning it; 1 if it has not been interned */
+    uint64_t hash;
+    uint32_t i, n, state;
+    assert(self);
+    assert(str || len == 0);
+    assert(id);
+    hash = shm_hash_bytes(str, len);
+    for (i = (uint32_t) hash & self->mask, n = 0; n <= self->mask; i = (i + 1) & self->mask, ++n) {
+        const intern_slot_t *slot = &self->slots[i];
+        state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        if (state == InternEmpty)
+            return 1;
+        if (state == InternWriting && shm_slot_wait_ready(&slot->state, InternWriting) != 0)
+            return 1;
+        if (intern_matches(self, slot, hash, str, len)) {
+            *id = slot->id;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static inline int
+intern_reserve(intern_table_t *self, size_t len, uint64_t *off)
+{
+    uint64_t need = (sizeof(uint32_t) + len + 1 + INTERN_ALIGN - 1) & ~(uint64_t) (INTERN_ALIGN - 1);
+    *off = __atomic_load_n(&self->hdr->arena_used, __ATOMIC_RELAXED);
+    do {
+        if (*off + need > self->hdr->arena_size)
+            return 1;
+    } while (!__atomic_compare_exchange_n(&self->hdr->arena_used, off, *off + need, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 0;
+}
+
+static inline int
+intern(intern_table_t *self, const char *str, size_t len, uint32_t *id)
+{
+    /* returns 0 with *id set, storing the string if it is new; 1 if the table or arena is full or a slot is stuck */
+    uint64_t hash, off;
+    uint32_t i, n, expected, next, stored_len;
+    assert(self);
+    assert(str || len == 0);
+    assert(id);
+    if (len > INTERN_MAX_LEN - 1)
+        return 1;
+    hash = shm_hash_bytes(str, len);
+    for (i = (uint32_t) hash & self->mask, n = 0; n <= self->mask; i = (i + 1) & self->mask, ++n) {
+        intern_slot_t *slot = &self->slots[i];
+        expected = InternEmpty;
+        if (__atomic_compare_exchange_n(&slot->state, &expected, InternWriting, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            if (intern_reserve(self, len, &off) != 0
+                || (next = __atomic_fetch_add(&self->hdr->next_id, 1, __ATOMIC_RELAXED)) >= self->hdr->nslots) {
+                /* out of space: publish a dead slot that never matches so probe chains stay intact */
+                slot->id = INTERN_NONE;
+                __atomic_store_n(&slot->state, InternReady, __ATOMIC_RELEASE);
+                return 1;
+            }
+            stored_len = (uint32_t) len;
+            memcpy(self->arena + off, &stored_len, sizeof(uint32_t));
+            memcpy(self->arena + off + sizeof(uint32_t), str, len);
+            self->arena[off + sizeof(uint32_t) + len] = '\0';
+            __atomic_store_n(&self->dir[next], off, __ATOMIC_RELEASE);
+            slot->hash = hash;
+            slot->id = next;
+            __atomic_store_n(&slot->state, InternReady, __ATOMIC_RELEASE);
+            *id = next;
+            return 0;
+        }
+        if (expected == InternWriting && shm_slot_wait_ready(&slot->state, InternWriting) != 0)
+            return 1;
+        if (intern_matches(self, slot, hash, str, len)) {
+            *id = slot->id;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#endif //P2PMD_SHM_INTERN_H
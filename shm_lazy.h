@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ */
+
+#ifndef P2PMD_SHM_LAZY_H
+#define P2PMD_SHM_LAZY_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include "shared_memory.h"
+#include "shm_wait.h"
+#ifdef __linux__
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#endif
+#if defined(__linux__) && defined(__NR_userfaultfd) && defined(UFFDIO_COPY)
+#define LAZY_HAVE_UFFD 1
+#ifndef UFFD_USER_MODE_ONLY
+/* headers older than 5.11 lack the flag; without it the first userfaultfd() call is the plain one */
+#define UFFD_USER_MODE_ONLY 0
+#endif
+#endif
+
+/***************************************************************************************************************\
+|*  Lazy transfer of huge messages                                                                             *|
+|***************************************************************************************************************|
+|*  The sender builds the message in a lazy buffer - a segment of its own, filled in place - and send_lazy()   *|
+|*  ships only the buffer's name and length over an ordinary channel. recv_lazy() reserves an address range   *|
+|*  of the message's size and returns at once, whatever the size: the range is registered with userfaultfd    *|
+|*  and a fault thread fills each page from the sender's buffer (UFFDIO_COPY, LAZY_FAULT_BYTES at a time) the  *|
+|*  first time the receiver touches it. Pages the receiver never touches are never copied. The receiver owns  *|
+|*  its copy: it may write to it, and the sender's later changes do not show up in pages already filled.       *|
+|*                                                                                                             *|
+|*  The sender must leave the buffer alone until the receiver calls lazy_release(), which it can wait for      *|
+|*  with lazy_wait_released(). Without userfaultfd (not Linux, or vm.unprivileged_userfaultfd = 0 and an       *|
+|*  older kernel) recv_lazy() copies the whole message before returning and reports LazyCopied instead.        *|
+|*  A lazy_view_t is used by its fault thread and must not be moved between recv_lazy() and lazy_release().    *|
+\***************************************************************************************************************/
+
+/************************************************************\
+|* Lazy buffer segment layout                               *|
+|************************************************************|
+|* 1) lazy_header_t, padded to one page                     *|
+|* 2) message bytes, page aligned, capacity rounded up to   *|
+|*    whole pages                                           *|
+\************************************************************/
+
+#define LAZY_MAGIC 0x4c415a59u
+#define LAZY_REF_MAGIC 0x4c524546u
+#define LAZY_NAME_MAX 48
+#define LAZY_FAULT_BYTES (64 * 1024)
+
+typedef enum _lazy_mode {
+    LazyFaulting = 1, LazyCopied = 2
+} lazy_mode_t;
+
+typedef struct _lazy_header {
+    volatile uint32_t magic;
+    uint32_t pad;
+    uint64_t capacity;
+    volatile uint64_t len;
+    volatile uint32_t released;
+    volatile uint32_t waiters;
+} lazy_header_t;
+
+typedef struct _lazy_ref {
+    uint32_t magic;
+    uint32_t pad;
+    uint64_t len;
+    char name[LAZY_NAME_MAX];
+} lazy_ref_t;
+
+typedef struct _lazy_buffer {
+    shared_segment_t segment;
+    lazy_header_t *hdr;
+    void *data;
+    size_t capacity;
+    char name[LAZY_NAME_MAX];
+} lazy_buffer_t;
+
+typedef struct _lazy_view {
+    shared_segment_t source;
+    lazy_header_t *hdr;
+    const char *src;
+    void *data;                 /* the received message, valid until lazy_release() */
+    size_t len;
+    size_t mapped;              /* len rounded up to whole pages */
+    lazy_mode_t mode;
+    int uffd;
+    int stop_fd;
+    pthread_t thread;
+    volatile uint64_t faults;   /* page faults served */
+    volatile uint64_t filled;   /* bytes copied into the range so far */
+} lazy_view_t;
+
+static inline size_t
+lazy_page_size(void)
+{
+    return (size_t) sysconf(_SC_PAGESIZE);
+}
+
+static inline int
+create_lazy_buffer(lazy_buffer_t *self, const char *name, size_t capacity)
+{
+    /* the message is written to self->data, up to `capacity` bytes, and sent with send_lazy() */
+    size_t page = lazy_page_size();
+    assert(self);
+    assert(name);
+    assert(capacity > 0);
+    if (strlen(name) >= LAZY_NAME_MAX)
+        return 1;
+    capacity = (capacity + page - 1) & ~(page - 1);
+    if (map_shared_segment(&self->segment, name, page + capacity) != 0)
+        return 1;
+    self->hdr = (lazy_header_t *) self->segment.data;
+    memset(self->hdr, 0, sizeof(lazy_header_t));
+    self->hdr->capacity = capacity;
+    self->data = (char *) self->segment.data + page;
+    self->capacity = capacity;
+    strcpy(self->name, name);
+    __atomic_store_n(&self->hdr->magic, LAZY_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static inline void
+close_lazy_buffer(lazy_buffer_t *self)
+{
+    assert(self);
+    detach_shared_segment(&self->segment);
+    shm_unlink(self->name);
+    self->hdr = NULL;
+    self->data = NULL;
+}
+
+static inline int
+send_lazy(shared_memory_t *shm, lazy_buffer_t *buf, size_t len)
+{
+    /* sends the first len bytes of buf->data; buf must not change until lazy_wait_released() returns 0 */
+    lazy_ref_t ref;
+    assert(buf);
+    if (len == 0 || len > buf->capacity)
+        return 1;
+    buf->hdr->len = len;
+    __atomic_store_n(&buf->hdr->released, 0, __ATOMIC_RELEASE);
+    memset(&ref, 0, sizeof(ref));
+    ref.magic = LAZY_REF_MAGIC;
+    ref.len = len;
+    strcpy(ref.name, buf->name);
+    return send_item(shm, &ref, sizeof(ref));
+}
+
+static inline int
+lazy_wait_released(lazy_buffer_t *buf, uint64_t timeout_ns)
+{
+    /* returns 0 once the receiver is done with the message, 1 on timeout */
+    wait_policy_t policy = {WaitBlock, 0};
+    assert(buf);
+    while (__atomic_load_n(&buf->hdr->released, __ATOMIC_ACQUIRE) == 0)
+        if (wait_for_change(&buf->hdr->released, 0, &buf->hdr->waiters, &policy, timeout_ns) != 0)
+            return 1;
+    return 0;
+}
+
+#ifdef LAZY_HAVE_UFFD
+static inline void
+lazy_fill(lazy_view_t *self, uintptr_t addr)
+{
+    /* fills the faulting page and the following ones up to LAZY_FAULT_BYTES, stopping at pages already there */
+    size_t page = lazy_page_size();
+    uintptr_t base = (uintptr_t) self->data, start = addr & ~(uintptr_t) (page - 1);
+    size_t off = start - base, n = self->mapped - off;
+    struct uffdio_copy copy;
+    struct uffdio_range range;
+    if (n > LAZY_FAULT_BYTES)
+        n = LAZY_FAULT_BYTES;
+    copy.dst = start;
+    copy.src = (uintptr_t) (self->src + off);
+    copy.len = n;
+    copy.mode = 0;
+    copy.copy = 0;
+    if (ioctl(self->uffd, UFFDIO_COPY, &copy) != 0 && copy.copy < (int64_t) page) {
+        /* a page after the first is already present (EEXIST): retry the faulting page alone */
+        copy.len = page;
+        copy.copy = 0;
+        if (ioctl(self->uffd, UFFDIO_COPY, &copy) != 0 && errno == EEXIST) {
+            range.start = start;
+            range.len = page;
+            ioctl(self->uffd, UFFDIO_WAKE, &range);
+        }
+    }
+    ++self->faults;
+    if (copy.copy > 0)
+        self->filled += (uint64_t) copy.copy;
+}
+
+static void *
+lazy_fault_thread(void *p)
+{
+    lazy_view_t *self = (lazy_view_t *) p;
+    struct pollfd fds[2];
+    struct uffd_msg msg;
+    fds[0].fd = self->uffd;
+    fds[0].events = POLLIN;
+    fds[1].fd = self->stop_fd;
+    fds[1].events = POLLIN;
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        if (read(self->uffd, &msg, sizeof(msg)) != (ssize_t) sizeof(msg))
+            continue;
+        if (msg.event == UFFD_EVENT_PAGEFAULT)
+            lazy_fill(self, (uintptr_t) msg.arg.pagefault.address);
+    }
+    return NULL;
+}
+
+static inline int
+lazy_map_faulting(lazy_view_t *self)
+{
+    struct uffdio_api api;
+    struct uffdio_register reg;
+    self->uffd = (int) syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+    if (self->uffd < 0 && errno == EINVAL)
+        /* kernels before 5.11 do not know UFFD_USER_MODE_ONLY */
+        self->uffd = (int) syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (self->uffd < 0)
+        return 1;
+    memset(&api, 0, sizeof(api));
+    api.api = UFFD_API;
+    memset(&reg, 0, sizeof(reg));
+    reg.range.start = (uintptr_t) self->data;
+    reg.range.len = self->mapped;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+    if (ioctl(self->uffd, UFFDIO_API, &api) != 0 || ioctl(self->uffd, UFFDIO_REGISTER, &reg) != 0)
+        goto lazy_map_failed;
+    self->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (self->stop_fd < 0)
+        goto lazy_map_failed;
+    if (pthread_create(&self->thread, NULL, lazy_fault_thread, self) != 0) {
+        close(self->stop_fd);
+        self->stop_fd = -1;
+        goto lazy_map_failed;
+    }
+    self->mode = LazyFaulting;
+    return 0;
+lazy_map_failed:
+    close(self->uffd);
+    self->uffd = -1;
+    return 1;
+}
+#endif
+
+static inline int
+recv_lazy(shared_memory_t *shm, lazy_view_t *view)
+{
+    /* receives a message sent with send_lazy(); view->data holds it until lazy_release(view) */
+    lazy_ref_t *ref;
+    void *msg;
+    size_t msg_len, page = lazy_page_size();
+    int rt = 1;
+    assert(view);
+    memset(view, 0, sizeof(*view));
+    view->uffd = -1;
+    view->stop_fd = -1;
+    view->source.fd = -1;
+    if (recv_item(shm, &msg, &msg_len) != 0)
+        return 1;
+    ref = (lazy_ref_t *) msg;
+    if (msg_len != sizeof(lazy_ref_t) || ref->magic != LAZY_REF_MAGIC || ref->len == 0
+        || memchr(ref->name, '\0', LAZY_NAME_MAX) == NULL || attach_shared_segment(&view->source, ref->name) != 0)
+        goto recv_lazy_done;
+    view->hdr = (lazy_header_t *) view->source.data;
+    view->src = (const char *) view->source.data + page;
+    view->len = ref->len;
+    view->mapped = (ref->len + page - 1) & ~(page - 1);
+    if (view->source.size < page || __atomic_load_n(&view->hdr->magic, __ATOMIC_ACQUIRE) != LAZY_MAGIC
+        || view->hdr->len != ref->len || view->mapped > view->source.size - page) {
+        detach_shared_segment(&view->source);
+        goto recv_lazy_done;
+    }
+    view->data = mmap(NULL, view->mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (view->data == MAP_FAILED) {
+        view->data = NULL;
+        detach_shared_segment(&view->source);
+        goto recv_lazy_done;
+    }
+    rt = 0;
+#ifdef LAZY_HAVE_UFFD
+    if (lazy_map_faulting(view) == 0)
+        goto recv_lazy_done;
+#endif
+    /* no userfaultfd: copy everything now */
+    memcpy(view->data, view->src, view->len);
+    view->filled = view->len;
+    view->mode = LazyCopied;
+recv_lazy_done:
+    free(msg);
+    return rt;
+}
+
+static inline void
+lazy_release(lazy_view_t *view)
+{
+    /* unmaps the message and tells the sender its buffer is free again */
+    assert(view);
+#ifdef LAZY_HAVE_UFFD
+    if (view->mode == LazyFaulting) {
+        uint64_t one = 1;
+        if (write(view->stop_fd, &one, sizeof(one)) == (ssize_t) sizeof(one))
+            pthread_join(view->thread, NULL);
+        close(view->stop_fd);
+        close(view->uffd);
+        view->stop_fd = -1;
+        view->uffd = -1;
+    }
+#endif
+    if (view->data != NULL)
+        munmap(view->data, view->mapped);
+    view->data = NULL;
+    if (view->hdr != NULL) {
+        __atomic_store_n(&view->hdr->released, 1, __ATOMIC_RELEASE);
+        notify_change(&view->hdr->released, &view->hdr->waiters);
+    }
+    view->hdr = NULL;
+    detach_shared_segment(&view->source);
+}
+
+#endif //P2PMD_SHM_LAZY_H
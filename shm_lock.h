@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ */
+
+#ifndef P2PMD_SHM_LOCK_H
+#define P2PMD_SHM_LOCK_H
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "shm_wait.h"
+
+/***************************************************************************************************************\
+|*  Process-shared locks that live inside a segment                                                            *|
+|***************************************************************************************************************|
+|*  Both locks are plain structs placed anywhere in a shared mapping and initialised once (zeroed memory is    *|
+|*  an unlocked lock). They wait with wait_for_change() from shm_wait.h: spin briefly, then futex-sleep on     *|
+|*  the word, and the releasing side only enters the kernel when somebody is asleep.                           *|
+|*                                                                                                             *|
+|*  shm_mutex_t is a ticket lock: lock takes a ticket with one fetch_add on `next` and waits until `serving`   *|
+|*  reaches it, unlock increments `serving`. Waiters are served in FIFO order, so no process starves. Only the *|
+|*  next ticket spins; the others sleep on `serving` with a futex bitset of one bit per ticket (mod 32), and   *|
+|*  unlock wakes just the bit of the ticket it hands over to, so a handoff does not wake the whole queue.      *|
+|*                                                                                                             *|
+|*  shm_rwlock_t spreads readers over SHM_RW_SLOTS counters, one cache line each. A reader increments the      *|
+|*  counter of its own slot (chosen once per thread; rdlock returns it and rdunlock takes it back) and checks  *|
+|*  that no writer is present. Readers on different slots never write the same line, so read-mostly data       *|
+|*  scales with the number of readers instead of bouncing one counter between cores. A writer takes the        *|
+|*  writer mutex, raises `writer` (new readers back off) and waits for every slot to drain, so writers are     *|
+|*  preferred and cannot be starved by readers.                                                                *|
+|*  Neither lock is robust: a process that dies holding one leaves it held.                                    *|
+\***************************************************************************************************************/
+
+#define SHM_LOCK_CACHELINE 64
+#define SHM_RW_SLOTS 64
+#define SHM_MUTEX_TICKET_BIT(t) (1u << ((t) % 32))
+
+typedef struct _shm_mutex {
+    volatile uint32_t next;
+    volatile uint32_t serving;
+    volatile uint32_t waiters;
+    char pad[SHM_LOCK_CACHELINE - 3 * sizeof(uint32_t)];
+} shm_mutex_t;
+
+typedef struct _shm_rw_slot {
+    volatile uint32_t readers;
+    volatile uint32_t waiters;
+    char pad[SHM_LOCK_CACHELINE - 2 * sizeof(uint32_t)];
+} shm_rw_slot_t;
+
+typedef struct _shm_rwlock {
+    shm_mutex_t wmutex;
+    volatile uint32_t writer;
+    volatile uint32_t waiters;
+    char pad[SHM_LOCK_CACHELINE - 2 * sizeof(uint32_t)];
+    shm_rw_slot_t slots[SHM_RW_SLOTS];
+} shm_rwlock_t;
+
+static const wait_policy_t shm_lock_spin = {WaitAdaptive, WAIT_DEFAULT_SPINS};
+static const wait_policy_t shm_lock_block = {WaitBlock, 0};
+
+static inline const wait_policy_t *
+shm_lock_policy(void)
+{
+    /* spinning on a uniprocessor only burns the time slice the lock holder needs */
+    static int smp = -1;
+    if (smp < 0)
+        smp = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+    return smp ? &shm_lock_spin : &shm_lock_block;
+}
+
+static inline void
+shm_mutex_init(shm_mutex_t *self)
+{
+    assert(self);
+    memset(self, 0, sizeof(*self));
+}
+
+static inline void
+shm_mutex_sleep(shm_mutex_t *self, uint32_t now, uint32_t ticket)
+{
+    /* sleeps until `serving` leaves `now`; only the unlock handing over to a ticket sharing our bit wakes us */
+#ifdef __linux__
+    __atomic_add_fetch(&self->waiters, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&self->serving, __ATOMIC_SEQ_CST) == now)
+        syscall(SYS_futex, (uint32_t *) &self->serving, FUTEX_WAIT_BITSET, now, NULL, NULL,
+                SHM_MUTEX_TICKET_BIT(ticket));
+    __atomic_sub_fetch(&self->waiters, 1, __ATOMIC_SEQ_CST);
+#else
+    (void) ticket;
+    wait_for_change(&self->serving, now, &self->waiters, &shm_lock_block, 0);
+#endif
+}
+
+static inline void
+shm_mutex_lock(shm_mutex_t *self)
+{
+    uint32_t ticket = __atomic_fetch_add(&self->next, 1, __ATOMIC_RELAXED), now;
+    /* only the next in line spins, and only if the holder can be running meanwhile; the others sleep */
+    while ((now = __atomic_load_n(&self->serving, __ATOMIC_ACQUIRE)) != ticket) {
+        if (ticket - now == 1)
+            wait_for_change(&self->serving, now, &self->waiters, shm_lock_policy(), 0);
+        else
+            shm_mutex_sleep(self, now, ticket);
+    }
+}
+
+static inline int
+shm_mutex_trylock(shm_mutex_t *self)
+{
+    /* returns 0 if the lock was taken, 1 if it is held or contended */
+    uint32_t serving = __atomic_load_n(&self->serving, __ATOMIC_ACQUIRE), expected = serving;
+    return __atomic_compare_exchange_n(&self->next, &expected, serving + 1, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ? 0 : 1;
+}
+
+static inline void
+shm_mutex_unlock(shm_mutex_t *self)
+{
+    uint32_t next = self->serving + 1;
+    __atomic_store_n(&self->serving, next, __ATOMIC_RELEASE);
+#ifdef __linux__
+    /* wakes the new holder (and any sleeper sharing its bit), not the whole queue */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&self->waiters, __ATOMIC_RELAXED) != 0)
+        syscall(SYS_futex, (uint32_t *) &self->serving, FUTEX_WAKE_BITSET, 0x7fffffff, NULL, NULL,
+                SHM_MUTEX_TICKET_BIT(next));
+#else
+    notify_change(&self->serving, &self->waiters);
+#endif
+}
+
+static inline void
+shm_rwlock_init(shm_rwlock_t *self)
+{
+    assert(self);
+    memset(self, 0, sizeof(*self));
+}
+
+static inline unsigned
+shm_rw_slot(void)
+{
+    /* per-thread slot: threads of one process are spread round-robin, processes are offset by pid */
+    static __thread int slot = -1;
+    static unsigned counter = 0;
+    unsigned base;
+    if (slot < 0) {
+        base = ((unsigned) getpid() * 2654435761u) >> 16;
+        slot = (int) ((base + __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED)) % SHM_RW_SLOTS);
+    }
+    return (unsigned) slot;
+}
+
+static inline unsigned
+shm_rwlock_rdlock(shm_rwlock_t *self)
+{
+    /* returns the slot to hand back to shm_rwlock_rdunlock() */
+    unsigned index = shm_rw_slot();
+    shm_rw_slot_t *slot = &self->slots[index];
+    for (;;) {
+        __atomic_add_fetch(&slot->readers, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&self->writer, __ATOMIC_SEQ_CST) == 0)
+            return index;
+        /* a writer is in or draining: step aside so it can finish, then retry */
+        __atomic_sub_fetch(&slot->readers, 1, __ATOMIC_SEQ_CST);
+        notify_change(&slot->readers, &slot->waiters);
+        while (__atomic_load_n(&self->writer, __ATOMIC_ACQUIRE) != 0)
+            wait_for_change(&self->writer, 1, &self->waiters, shm_lock_policy(), 0);
+    }
+}
+
+static inline void
+shm_rwlock_rdunlock(shm_rwlock_t *self, unsigned index)
+{
+    shm_rw_slot_t *slot = &self->slots[index];
+    assert(index < SHM_RW_SLOTS);
+    __atomic_sub_fetch(&slot->readers, 1, __ATOMIC_SEQ_CST);
+    notify_change(&slot->readers, &slot->waiters);
+}
+
+static inline void
+shm_rwlock_wrlock(shm_rwlock_t *self)
+{
+    unsigned i;
+    uint32_t n;
+    shm_mutex_lock(&self->wmutex);
+    __atomic_store_n(&self->writer, 1, __ATOMIC_SEQ_CST);
+    for (i = 0; i < SHM_RW_SLOTS; ++i)
+        while ((n = __atomic_load_n(&self->slots[i].readers, __ATOMIC_ACQUIRE)) != 0)
+            wait_for_change(&self->slots[i].readers, n, &self->slots[i].waiters, shm_lock_policy(), 0);
+}
+
+static inline void
+shm_rwlock_wrunlock(shm_rwlock_t *self)
+{
+    __atomic_store_n(&self->writer, 0, __ATOMIC_RELEASE);
+    notify_change(&self->writer, &self->waiters);
+    shm_mutex_unlock(&self->wmutex);
+}
+
+#endif //P2PMD_SHM_LOCK_H
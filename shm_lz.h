@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ */
+
+#ifndef P2PMD_SHM_LZ_H
+#define P2PMD_SHM_LZ_H
+
+#include <stdint.h>
+#include <string.h>
+
+/***************************************************************************************************************\
+|*  Dependency-free LZ77 block codec (LZ4-style sequences)                                                     *|
+|***************************************************************************************************************|
+|*  A block is a list of sequences:                                                                            *|
+|*    token (literal length : 4 | match length - 4 : 4), [length bytes], literals, offset (u16 LE),            *|
+|*    [match length bytes]                                                                                     *|
+|*  A 4-bit field of 15 continues in following bytes (255 means "add and continue"). The last sequence has    *|
+|*  only literals. Matches are found with a single-probe hash table over 4-byte windows and a search step     *|
+|*  that grows with consecutive misses, so incompressible stretches are skipped quickly.                      *|
+|*                                                                                                             *|
+|*  lz_compress() gives up and returns 0 as soon as the output would exceed `cap`, and also after the first   *|
+|*  LZ_PROBE_BYTES of input if they shrank by less than 1/32: callers pass a cap below the input size and     *|
+|*  send the data raw on 0. lz_decompress() bounds-checks every length and offset against both buffers, so a  *|
+|*  corrupt or hostile block is rejected instead of overrunning memory.                                        *|
+\***************************************************************************************************************/
+
+#define LZ_HASH_LOG 13
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MFLIMIT 12
+#define LZ_MAX_OFFSET 65535
+#define LZ_SKIP_TRIGGER 6
+#define LZ_PROBE_BYTES 65536
+
+static inline uint32_t
+lz_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t
+lz_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+static inline uint8_t *
+lz_put_length(uint8_t *op, size_t len)
+{
+    /* continuation bytes for a length whose 4-bit token field is saturated at 15 */
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t) len;
+    return op;
+}
+
+static inline size_t
+lz_compress(const void *src, size_t n, void *dst, size_t cap)
+{
+    /* returns the compressed size, or 0 if it would not fit in cap bytes (send the input raw) */
+    const uint8_t *base = (const uint8_t *) src, *ip = base, *anchor = base;
+    const uint8_t *iend = base + n, *mflimit = iend - LZ_MFLIMIT, *matchlimit = iend - LZ_LAST_LITERALS;
+    const uint8_t *probe = base + LZ_PROBE_BYTES;
+    uint8_t *op = (uint8_t *) dst, *oend = op + cap, *token;
+    uint32_t table[1 << LZ_HASH_LOG];
+    size_t litlen;
+    memset(table, 0, sizeof(table));
+    if (n < LZ_MFLIMIT + 1)
+        goto last_literals;
+    ++ip;
+    for (;;) {
+        const uint8_t *match, *start;
+        unsigned searches = 1u << LZ_SKIP_TRIGGER, step = 1;
+        size_t mlen;
+        uint16_t off;
+        /* find a 4-byte match within 64KB behind ip */
+        for (;;) {
+            uint32_t h = lz_hash(lz_read32(ip));
+            match = base + table[h];
+            table[h] = (uint32_t) (ip - base);
+            if (match < ip && ip - match <= LZ_MAX_OFFSET && lz_read32(match) == lz_read32(ip))
+                break;
+            ip += step;
+            step = searches++ >> LZ_SKIP_TRIGGER;
+            if (ip > mflimit)
+                goto last_literals;
+        }
+        while (ip > anchor && match > base && ip[-1] == match[-1]) {
+            --ip;
+            --match;
+        }
+        /* literals */
+        litlen = (size_t) (ip - anchor);
+        token = op++;
+        if (op + litlen + litlen / 255 + 1 + 2 + LZ_LAST_LITERALS + 1 > oend)
+            return 0;
+        if (litlen >= 15) {
+            *token = 15 << 4;
+            op = lz_put_length(op, litlen - 15);
+        } else
+            *token = (uint8_t) (litlen << 4);
+        memcpy(op, anchor, litlen);
+        op += litlen;
+        /* offset and match length */
+        off = (uint16_t) (ip - match);
+        *op++ = (uint8_t) off;
+        *op++ = (uint8_t) (off >> 8);
+        ip += LZ_MIN_MATCH;
+        match += LZ_MIN_MATCH;
+        start = ip;
+        while (ip + 8 <= matchlimit) {
+            uint64_t a, b;
+            memcpy(&a, ip, 8);
+            memcpy(&b, match, 8);
+            if (a != b) {
+                ip += (unsigned) __builtin_ctzll(a ^ b) >> 3;   /* little-endian: first differing byte */
+                goto match_done;
+            }
+            ip += 8;
+            match += 8;
+        }
+        while (ip < matchlimit && *ip == *match) {
+            ++ip;
+            ++match;
+        }
+match_done:
+        mlen = (size_t) (ip - start);
+        if (op + mlen / 255 + 1 + LZ_LAST_LITERALS + 1 > oend)
+            return 0;
+        if (mlen >= 15) {
+            *token |= 15;
+            op = lz_put_length(op, mlen - 15);
+        } else
+            *token |= (uint8_t) mlen;
+        anchor = ip;
+        if (ip > mflimit)
+            break;
+        table[lz_hash(lz_read32(ip - 2))] = (uint32_t) (ip - 2 - base);
+        if (ip >= probe) {
+            /* early bypass: the first LZ_PROBE_BYTES did not compress enough to be worth it */
+            if ((size_t) (op - (uint8_t *) dst) > (size_t) (ip - base) - (size_t) (ip - base) / 32)
+                return 0;
+            probe = iend;
+        }
+    }
+last_literals:
+    litlen = (size_t) (iend - anchor);
+    if (op + 1 + litlen / 255 + 1 + litlen > oend)
+        return 0;
+    token = op++;
+    if (litlen >= 15) {
+        *token = 15 << 4;
+        op = lz_put_length(op, litlen - 15);
+    } else
+        *token = (uint8_t) (litlen << 4);
+    memcpy(op, anchor, litlen);
+    op += litlen;
+    return (size_t) (op - (uint8_t *) dst);
+}
+
+static inline int
+lz_get_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+    uint8_t b;
+    do {
+        if (*ip >= iend)
+            return 1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+static inline int
+lz_decompress(const void *src, size_t n, void *dst, size_t out_len)
+{
+    /* returns 0 iff the block decodes to exactly out_len bytes */
+    const uint8_t *ip = (const uint8_t *) src, *iend = ip + n, *match;
+    uint8_t *op = (uint8_t *) dst, *oend = op + out_len;
+    for (;;) {
+        size_t litlen, mlen, off;
+        uint8_t token;
+        if (ip >= iend)
+            return 1;
+        token = *ip++;
+        litlen = token >> 4;
+        if (litlen == 15 && lz_get_length(&ip, iend, &litlen) != 0)
+            return 1;
+        if (litlen > (size_t) (iend - ip) || litlen > (size_t) (oend - op))
+            return 1;
+        if (litlen <= 16 && iend - ip >= 16 && oend - op >= 16)
+            memcpy(op, ip, 16);
+        else
+            memcpy(op, ip, litlen);
+        op += litlen;
+        ip += litlen;
+        if (ip == iend)
+            break;
+        if (iend - ip < 2)
+            return 1;
+        off = (size_t) ip[0] | (size_t) ip[1] << 8;
+        ip += 2;
+        if (off == 0 || off > (size_t) (op - (uint8_t *) dst))
+            return 1;
+        mlen = token & 15;
+        if (mlen == 15 && lz_get_length(&ip, iend, &mlen) != 0)
+            return 1;
+        mlen += LZ_MIN_MATCH;
+        if (mlen > (size_t) (oend - op))
+            return 1;
+        match = op - off;
+        if (off >= 8 && (size_t) (oend - op) >= mlen + 8) {
+            /* far from the end: copy whole words and let the last one spill into bytes written later */
+            uint8_t *mend = op + mlen;
+            for (; op < mend; op += 8, match += 8)
+                memcpy(op, match, 8);
+            op = mend;
+            continue;
+        }
+        while (mlen--)
+            *op++ = *match++;
+    }
+    return op == oend ? 0 : 1;
+}
+
+#endif //P2PMD_SHM_LZ_H
@@ -0,0 +1,413 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ */
+
+#ifndef P2PMD_SHM_PARALLEL_H
+#define P2PMD_SHM_PARALLEL_H
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <stdint.h>
+#include <string.h>
+#include "shm_segment.h"
+#include "shm_wait.h"
+
+/***************************************************************************************************************\
+|*  Cross-process parallel_for / map_reduce over a shared array                                                *|
+|***************************************************************************************************************|
+|*  A coordinator creates a pool segment holding a data area and one slot per participant; worker processes    *|
+|*  attach and sit in parallel_worker(). The coordinator fills the data area in place and posts a job: a       *|
+|*  kernel id, an item count, a grain and up to PARALLEL_MAX_ARG bytes of arguments. Items are split into one  *|
+|*  range per slot. Each participant - the coordinator included - claims `grain` items at a time from its own  *|
+|*  range with one fetch_add on the range's `next`, and once that is exhausted steals grains from the other    *|
+|*  ranges the same way, so a slow or absent worker's share is finished by the others. The kernel runs on      *|
+|*  the shared data directly; nothing is copied to or from workers.                                            *|
+|*                                                                                                             *|
+|*  Kernels are functions, and function addresses differ between processes, so jobs name them by id: every     *|
+|*  process registers the same ids on its handle with parallel_register() before taking part. For map_reduce   *|
+|*  the kernel folds its items into the participant's partial result, which lives in the participant's slot    *|
+|*  and starts as the job's identity value; the coordinator combines the partials in place once every item is  *|
+|*  counted in `completed`.                                                                                    *|
+|*                                                                                                             *|
+|*  job_seq is odd while the coordinator rewrites the job. A worker announces itself in `busy` and re-checks   *|
+|*  job_seq before reading the job, and the coordinator waits for `busy` to drain after making job_seq odd, so *|
+|*  a worker never runs one job's kernel over the next job's ranges. One coordinator per pool.                 *|
+|*                                                                                                             *|
+|*  A worker that dies in the middle of a job takes its current grain and its `busy` count with it. The        *|
+|*  coordinator checks the workers' pids whenever a wait exceeds PARALLEL_CHECK_NS; if one that was taking     *|
+|*  part in a job is gone, parallel_map_reduce() fails and the pool has to be recreated.                       *|
+\***************************************************************************************************************/
+
+/************************************************************\
+|* Parallel pool segment layout                             *|
+|************************************************************|
+|* 1) parallel_header_t (job descriptor included)           *|
+|* 2) parallel_slot_t slots[nworkers + 1], the last one     *|
+|*    being the coordinator's                               *|
+|* 3) char data[data_size], PARALLEL_LINE aligned           *|
+\************************************************************/
+
+#define PARALLEL_MAGIC 0x50415241u
+#define PARALLEL_LINE 64
+#define PARALLEL_MAX_KERNELS 256
+#define PARALLEL_MAX_ARG 256
+#define PARALLEL_MAX_RESULT 64
+#define PARALLEL_QUIT 0xffffffffu
+#define PARALLEL_CHECK_NS 10000000ull
+
+/* runs items [begin, end) of the job over data; partial is NULL for parallel_for */
+typedef void (*parallel_map_fn)(void *data, uint64_t begin, uint64_t end, const void *arg, void *partial);
+/* folds partial result `from` into `into` */
+typedef void (*parallel_combine_fn)(void *into, const void *from);
+
+typedef struct _parallel_kernel {
+    parallel_map_fn map;
+    parallel_combine_fn combine;
+} parallel_kernel_t;
+
+typedef struct _parallel_job {
+    uint32_t kernel;
+    uint32_t arg_len;
+    uint64_t count;
+    uint64_t grain;
+    uint32_t result_size;
+    uint32_t pad;
+    char arg[PARALLEL_MAX_ARG];
+} parallel_job_t;
+
+typedef struct _parallel_header {
+    volatile uint32_t magic;
+    uint32_t nworkers;
+    uint64_t data_size;
+    volatile uint32_t joined;
+    char pad0[PARALLEL_LINE - 3 * sizeof(uint32_t) - sizeof(uint64_t)];
+    volatile uint32_t job_seq;
+    volatile uint32_t job_waiters;
+    char pad1[PARALLEL_LINE - 2 * sizeof(uint32_t)];
+    volatile uint32_t busy;
+    volatile uint32_t busy_waiters;
+    char pad2[PARALLEL_LINE - 2 * sizeof(uint32_t)];
+    volatile uint32_t finished;
+    volatile uint32_t finished_waiters;
+    volatile uint64_t completed;
+    char pad3[PARALLEL_LINE - 2 * sizeof(uint32_t) - sizeof(uint64_t)];
+    parallel_job_t job;
+} parallel_header_t;
+
+typedef struct _parallel_slot {
+    volatile uint64_t next;     /* claimed by the owner and by stealers */
+    uint64_t end;
+    volatile int32_t pid;       /* of the participant, 0 until one joins */
+    volatile uint32_t active;   /* set while the participant takes part in a job */
+    char pad[PARALLEL_LINE - 2 * sizeof(uint64_t) - 2 * sizeof(uint32_t)];
+    char partial[PARALLEL_MAX_RESULT];
+} parallel_slot_t;
+
+typedef struct _parallel {
+    shared_segment_t segment;
+    parallel_header_t *hdr;
+    parallel_slot_t *slots;
+    char *data;
+    unsigned nslots;
+    unsigned me;                /* this participant's slot */
+    wait_policy_t policy;
+    parallel_kernel_t kernels[PARALLEL_MAX_KERNELS];    /* process-local: function addresses */
+} parallel_t;
+
+static inline size_t
+parallel_slots_offset(void)
+{
+    /* slots start on their own cache line so that one slot's partial never shares a line with the next's */
+    return (sizeof(parallel_header_t) + PARALLEL_LINE - 1) & ~(size_t) (PARALLEL_LINE - 1);
+}
+
+static inline size_t
+parallel_data_offset(uint32_t nworkers)
+{
+    size_t off = parallel_slots_offset() + sizeof(parallel_slot_t) * (nworkers + 1);
+    return (off + PARALLEL_LINE - 1) & ~(size_t) (PARALLEL_LINE - 1);
+}
+
+static inline void
+parallel_bind(parallel_t *self)
+{
+    char *base = (char *) self->segment.data;
+    self->hdr = (parallel_header_t *) base;
+    self->slots = (parallel_slot_t *) (base + parallel_slots_offset());
+    self->data = base + parallel_data_offset(self->hdr->nworkers);
+    self->nslots = self->hdr->nworkers + 1;
+    self->policy.mode = WaitAdaptive;
+    self->policy.spins = WAIT_DEFAULT_SPINS;
+    memset(self->kernels, 0, sizeof(self->kernels));
+}
+
+static inline int
+create_parallel(parallel_t *self, const char *name, uint32_t nworkers, size_t data_size)
+{
+    /* the creator is the coordinator; nworkers processes may join with open_parallel() */
+    size_t size;
+    assert(self);
+    assert(name);
+    assert(nworkers > 0);
+    size = parallel_data_offset(nworkers) + data_size;
+    if (map_shared_segment(&self->segment, name, size) != 0)
+        return 1;
+    memset(self->segment.data, 0, parallel_data_offset(nworkers));
+    self->hdr = (parallel_header_t *) self->segment.data;
+    self->hdr->nworkers = nworkers;
+    self->hdr->data_size = data_size;
+    parallel_bind(self);
+    self->me = nworkers;
+    __atomic_store_n(&self->hdr->magic, PARALLEL_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static inline int
+open_parallel(parallel_t *self, const char *name)
+{
+    /* joins as a worker; fails once nworkers processes have joined */
+    uint32_t me;
+    assert(self);
+    assert(name);
+    if (attach_shared_segment(&self->segment, name) != 0)
+        return 1;
+    self->hdr = (parallel_header_t *) self->segment.data;
+    if (self->segment.size < sizeof(parallel_header_t)
+        || __atomic_load_n(&self->hdr->magic, __ATOMIC_ACQUIRE) != PARALLEL_MAGIC
+        || parallel_data_offset(self->hdr->nworkers) + self->hdr->data_size > self->segment.size
+        || (me = __atomic_fetch_add(&self->hdr->joined, 1, __ATOMIC_ACQ_REL)) >= self->hdr->nworkers) {
+        detach_shared_segment(&self->segment);
+        return 1;
+    }
+    parallel_bind(self);
+    self->me = me;
+    self->slots[me].pid = (int32_t) getpid();
+    return 0;
+}
+
+static inline int
+parallel_register(parallel_t *self, uint32_t id, parallel_map_fn map, parallel_combine_fn combine)
+{
+    /* after create_parallel()/open_parallel(); combine may be NULL for kernels only used with parallel_for() */
+    assert(self);
+    assert(map);
+    if (id >= PARALLEL_MAX_KERNELS)
+        return 1;
+    self->kernels[id].map = map;
+    self->kernels[id].combine = combine;
+    return 0;
+}
+
+static inline void
+detach_parallel(parallel_t *self)
+{
+    assert(self);
+    detach_shared_segment(&self->segment);
+    self->hdr = NULL;
+}
+
+static inline void
+close_parallel(const char *name)
+{
+    assert(name);
+    shm_unlink(name);
+}
+
+static inline void *
+parallel_data(parallel_t *self)
+{
+    /* the shared array; kernels receive this pointer */
+    return self->data;
+}
+
+static inline int
+parallel_claim(parallel_t *self, uint64_t grain, uint64_t *begin, uint64_t *end)
+{
+    /* one grain from our own range, or stolen from the next range that has any left; 1 when all are empty */
+    parallel_slot_t *s;
+    uint64_t b;
+    unsigned i;
+    for (i = 0; i < self->nslots; ++i) {
+        s = &self->slots[(self->me + i) % self->nslots];
+        if (__atomic_load_n(&s->next, __ATOMIC_RELAXED) >= s->end)
+            continue;
+        b = __atomic_fetch_add(&s->next, grain, __ATOMIC_RELAXED);
+        if (b >= s->end)
+            continue;
+        *begin = b;
+        *end = b + grain < s->end ? b + grain : s->end;
+        return 0;
+    }
+    return 1;
+}
+
+static inline void
+parallel_run(parallel_t *self, uint32_t seq)
+{
+    /* takes part in the current job until no grain is left */
+    parallel_job_t *job = &self->hdr->job;
+    parallel_map_fn map = job->kernel < PARALLEL_MAX_KERNELS ? self->kernels[job->kernel].map : NULL;
+    void *partial = job->result_size ? self->slots[self->me].partial : NULL;
+    uint64_t begin, end;
+    if (map == NULL)
+        return;                 /* kernel not registered here: the others steal our range */
+    while (parallel_claim(self, job->grain, &begin, &end) == 0) {
+        map(self->data, begin, end, job->arg, partial);
+        if (__atomic_add_fetch(&self->hdr->completed, end - begin, __ATOMIC_ACQ_REL) == job->count) {
+            __atomic_store_n(&self->hdr->finished, seq, __ATOMIC_RELEASE);
+            notify_change(&self->hdr->finished, &self->hdr->finished_waiters);
+        }
+    }
+}
+
+static inline int
+parallel_worker(parallel_t *self)
+{
+    /* runs jobs until the coordinator calls parallel_shutdown(); returns 0 then */
+    uint32_t seq, last = 0;
+    assert(self);
+    for (;;) {
+        seq = __atomic_load_n(&self->hdr->job_seq, __ATOMIC_ACQUIRE);
+        if ((seq & 1) || seq == last) {
+            wait_for_change(&self->hdr->job_seq, seq, &self->hdr->job_waiters, &self->policy, 0);
+            continue;
+        }
+        __atomic_store_n(&self->slots[self->me].active, 1, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&self->hdr->busy, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&self->hdr->job_seq, __ATOMIC_SEQ_CST) == seq) {
+            if (self->hdr->job.kernel == PARALLEL_QUIT) {
+                __atomic_sub_fetch(&self->hdr->busy, 1, __ATOMIC_SEQ_CST);
+                __atomic_store_n(&self->slots[self->me].active, 0, __ATOMIC_RELEASE);
+                notify_change(&self->hdr->busy, &self->hdr->busy_waiters);
+                return 0;
+            }
+            parallel_run(self, seq);
+            last = seq;
+        }
+        __atomic_sub_fetch(&self->hdr->busy, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&self->slots[self->me].active, 0, __ATOMIC_RELEASE);
+        notify_change(&self->hdr->busy, &self->hdr->busy_waiters);
+    }
+}
+
+static inline int
+parallel_pid_gone(int32_t pid)
+{
+    /* a dead child stays visible to kill() until it is reaped, so ask waitid() without reaping it */
+    siginfo_t info;
+    if (kill(pid, 0) != 0 && errno == ESRCH)
+        return 1;
+    memset(&info, 0, sizeof(info));
+    return waitid(P_PID, (id_t) pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == pid;
+}
+
+static inline int
+parallel_lost_worker(parallel_t *self)
+{
+    /* 1 if a worker died while taking part in a job: its grain and its `busy` count are never given back */
+    unsigned i;
+    int32_t pid;
+    for (i = 0; i < self->hdr->nworkers; ++i) {
+        pid = self->slots[i].pid;
+        if (pid > 0 && __atomic_load_n(&self->slots[i].active, __ATOMIC_ACQUIRE) && parallel_pid_gone(pid))
+            return 1;
+    }
+    return 0;
+}
+
+static inline int
+parallel_wait(parallel_t *self, volatile uint32_t *word, volatile uint32_t *waiters, uint32_t target)
+{
+    /* waits for *word == target, checking every PARALLEL_CHECK_NS that no worker died mid-job */
+    uint32_t now;
+    while ((now = __atomic_load_n(word, __ATOMIC_ACQUIRE)) != target)
+        if (wait_for_change(word, now, waiters, &self->policy, PARALLEL_CHECK_NS) != 0
+            && parallel_lost_worker(self))
+            return 1;
+    return 0;
+}
+
+static inline uint32_t
+parallel_post(parallel_t *self, uint32_t kernel, uint64_t count, uint64_t grain, const void *arg, size_t arg_len,
+              const void *identity, size_t result_size)
+{
+    /* publishes a job with every range and partial reset; returns its job_seq, 0 if a worker was lost */
+    parallel_header_t *hdr = self->hdr;
+    uint32_t seq = hdr->job_seq;
+    uint64_t share = (count + self->nslots - 1) / self->nslots;
+    unsigned i;
+    __atomic_store_n(&hdr->job_seq, seq + 1, __ATOMIC_SEQ_CST);
+    if (parallel_wait(self, &hdr->busy, &hdr->busy_waiters, 0) != 0)
+        return 0;
+    hdr->job.kernel = kernel;
+    hdr->job.count = count;
+    hdr->job.grain = grain ? grain : 1;
+    hdr->job.arg_len = (uint32_t) arg_len;
+    hdr->job.result_size = (uint32_t) result_size;
+    if (arg_len)
+        memcpy(hdr->job.arg, arg, arg_len);
+    for (i = 0; i < self->nslots; ++i) {
+        self->slots[i].next = share * i < count ? share * i : count;
+        self->slots[i].end = share * (i + 1) < count ? share * (i + 1) : count;
+        if (result_size)
+            memcpy(self->slots[i].partial, identity, result_size);
+    }
+    hdr->completed = 0;
+    __atomic_store_n(&hdr->job_seq, seq + 2, __ATOMIC_SEQ_CST);
+    notify_change(&hdr->job_seq, &hdr->job_waiters);
+    return seq + 2;
+}
+
+static inline int
+parallel_map_reduce(parallel_t *self, uint32_t kernel, uint64_t count, uint64_t grain, const void *arg,
+                    size_t arg_len, const void *identity, void *result, size_t result_size)
+{
+    /* Runs kernel over items [0, count) on all participants, this process included, and leaves the */
+    /* combination of every partial in result. identity is the partial each participant starts from.  */
+    /* Returns 1 without a result if a worker died during the job; the pool cannot be used after that.  */
+    parallel_kernel_t *k;
+    uint32_t seq;
+    unsigned i;
+    assert(self);
+    assert(self->me == self->hdr->nworkers);
+    assert(arg || arg_len == 0);
+    if (kernel >= PARALLEL_MAX_KERNELS || self->kernels[kernel].map == NULL || arg_len > PARALLEL_MAX_ARG
+        || result_size > PARALLEL_MAX_RESULT || (result_size && (!identity || !result)))
+        return 1;
+    k = &self->kernels[kernel];
+    if (result_size && k->combine == NULL)
+        return 1;
+    if (count > 0) {
+        seq = parallel_post(self, kernel, count, grain, arg, arg_len, identity, result_size);
+        if (seq == 0)
+            return 1;
+        parallel_run(self, seq);
+        if (parallel_wait(self, &self->hdr->finished, &self->hdr->finished_waiters, seq) != 0)
+            return 1;
+    }
+    if (result_size) {
+        memcpy(result, identity, result_size);
+        for (i = 0; count > 0 && i < self->nslots; ++i)
+            k->combine(result, self->slots[i].partial);
+    }
+    return 0;
+}
+
+static inline int
+parallel_for(parallel_t *self, uint32_t kernel, uint64_t count, uint64_t grain, const void *arg, size_t arg_len)
+{
+    return parallel_map_reduce(self, kernel, count, grain, arg, arg_len, NULL, NULL, 0);
+}
+
+static inline void
+parallel_shutdown(parallel_t *self)
+{
+    /* makes every parallel_worker() return */
+    assert(self);
+    parallel_post(self, PARALLEL_QUIT, 0, 1, NULL, 0, NULL, 0);
+}
+
+#endif //P2PMD_SHM_PARALLEL_H
@@ -0,0 +1,458 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ */
+
+#ifndef P2PMD_SHM_PUBSUB_H
+#define P2PMD_SHM_PUBSUB_H
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "shm_segment.h"
+#include "shm_wait.h"
+
+/***************************************************************************************************************\
+|*  Topic publish/subscribe over one shared log                                                                *|
+|***************************************************************************************************************|
+|*  Any number of publishers append messages to a single log; each message carries a topic (0..63). The log    *|
+|*  is an index of fixed 32-byte entries (topic, length, payload offset) plus a byte arena holding payloads,   *|
+|*  both used as rings. A publisher reserves an entry with one fetch_add on `head`, reserves payload space     *|
+|*  with one fetch_add on `arena_tail`, copies the payload once and publishes the entry by storing             *|
+|*  `seq = position + 1` last, as the trace ring does.                                                         *|
+|*                                                                                                             *|
+|*  Subscribers register a 64-bit topic mask in the subscriber table. Filtering is done on the index: a        *|
+|*  subscriber walks entries from its own cursor and looks at a payload only when the entry's topic is in its  *|
+|*  mask, so it never copies or touches messages of other topics. Publishers keep the union of all masks in    *|
+|*  `interest` and do not write messages nobody subscribed to at all. There is no back-pressure: a subscriber  *|
+|*  that falls more than one ring behind loses the overwritten messages and counts them in `dropped`.          *|
+|*                                                                                                             *|
+|*  pubsub_poll() returns a pointer into the arena without copying; pubsub_msg_valid() tells afterwards        *|
+|*  whether the payload may have been overwritten meanwhile. pubsub_recv() copies and validates in one call.   *|
+|*                                                                                                             *|
+|*  A message may carry a deadline (CLOCK_MONOTONIC ns, see pubsub_publish_ttl()). Subscribers skip expired    *|
+|*  messages while walking the index - the payload is never touched - and count them in `expired`, so a        *|
+|*  subscriber catching up after a stall goes straight to the messages that still matter. The clock is read    *|
+|*  once per poll, and only if an entry with a deadline is met.                                                *|
+|*                                                                                                             *|
+|*  A publisher that dies between reserving an entry and publishing it would stop every subscriber there, so   *|
+|*  a subscriber that still finds the entry reserved after PUBSUB_STALL_NS skips it and counts it in           *|
+|*  `dropped`. pubsub_reap() - run by pubsub_subscribe() when the table is full - frees the slots of           *|
+|*  subscribers whose process has died and drops their topics from `interest`.                                 *|
+\***************************************************************************************************************/
+
+/************************************************************\
+|* Pub/sub segment layout                                   *|
+|************************************************************|
+|* 1) pubsub_header_t (counters on separate cache lines)    *|
+|* 2) pubsub_sub_t subs[PUBSUB_MAX_SUBS]                    *|
+|* 3) pubsub_entry_t entries[entries]                       *|
+|* 4) char arena[arena_size]                                *|
+\************************************************************/
+
+#define PUBSUB_MAGIC 0x50554253u
+#define PUBSUB_TOPICS 64
+#define PUBSUB_MAX_SUBS 64
+#define PUBSUB_ALIGN 64
+#define PUBSUB_NO_SUB (-1)
+#define PUBSUB_STALL_NS 100000000ull
+
+typedef enum _pubsub_sub_state {
+    SubFree = 0, SubClaimed = 1, SubActive = 2
+} pubsub_sub_state_t;
+
+typedef struct _pubsub_entry {
+    volatile uint64_t seq;
+    uint32_t topic;
+    uint32_t len;
+    uint64_t off;
+    uint64_t deadline;          /* monotonic_ns() after which the message is dropped, 0 for none */
+} pubsub_entry_t;
+
+typedef struct _pubsub_sub {
+    volatile uint32_t state;
+    int32_t pid;
+    volatile uint64_t topics;
+    volatile uint64_t delivered;
+    volatile uint64_t dropped;
+    volatile uint64_t expired;
+    char pad[PUBSUB_ALIGN - 2 * sizeof(uint32_t) - 4 * sizeof(uint64_t)];
+} pubsub_sub_t;
+
+typedef struct _pubsub_header {
+    volatile uint32_t magic;
+    uint32_t entries;
+    uint64_t arena_size;
+    volatile uint64_t interest;
+    volatile uint64_t filtered;
+    char pad0[PUBSUB_ALIGN - 2 * sizeof(uint32_t) - 3 * sizeof(uint64_t)];
+    volatile uint64_t head;
+    char pad1[PUBSUB_ALIGN - sizeof(uint64_t)];
+    volatile uint64_t arena_tail;
+    char pad2[PUBSUB_ALIGN - sizeof(uint64_t)];
+    volatile uint32_t notify;
+    volatile uint32_t waiters;
+    char pad3[PUBSUB_ALIGN - 2 * sizeof(uint32_t)];
+} pubsub_header_t;
+
+typedef struct _pubsub_msg {
+    uint64_t seq;
+    uint32_t topic;
+    uint32_t len;
+    const void *data;
+    uint64_t off;
+} pubsub_msg_t;
+
+typedef struct _pubsub {
+    shared_segment_t segment;
+    pubsub_header_t *hdr;
+    pubsub_sub_t *subs;
+    pubsub_entry_t *entries;
+    char *arena;
+    uint64_t mask;
+    int sub;                    /* this process's subscriber slot, PUBSUB_NO_SUB when only publishing */
+    uint64_t cursor;            /* next log position this subscriber looks at */
+    uint64_t stall_pos;         /* an entry seen reserved but unpublished, and since when */
+    uint64_t stall_since;
+    wait_policy_t policy;
+} pubsub_t;
+
+static inline size_t
+pubsub_segment_size(uint32_t entries, size_t arena_size)
+{
+    return sizeof(pubsub_header_t) + sizeof(pubsub_sub_t) * PUBSUB_MAX_SUBS + sizeof(pubsub_entry_t) * entries
+           + arena_size;
+}
+
+static inline void
+pubsub_bind(pubsub_t *self)
+{
+    char *base = (char *) self->segment.data;
+    self->hdr = (pubsub_header_t *) base;
+    self->subs = (pubsub_sub_t *) (base + sizeof(pubsub_header_t));
+    self->entries = (pubsub_entry_t *) (self->subs + PUBSUB_MAX_SUBS);
+    self->arena = (char *) (self->entries + self->hdr->entries);
+    self->mask = self->hdr->entries - 1;
+    self->sub = PUBSUB_NO_SUB;
+    self->cursor = 0;
+    self->stall_since = 0;
+    self->policy.mode = WaitAdaptive;
+    self->policy.spins = WAIT_DEFAULT_SPINS;
+}
+
+static inline int
+create_pubsub(pubsub_t *self, const char *name, uint32_t entries, size_t arena_size)
+{
+    /* precondition: entries is a power of two, arena_size a multiple of PUBSUB_ALIGN */
+    size_t size;
+    assert(self);
+    assert(name);
+    assert(entries > 0 && (entries & (entries - 1)) == 0);
+    assert(arena_size > 0 && arena_size % PUBSUB_ALIGN == 0);
+    size = pubsub_segment_size(entries, arena_size);
+    if (map_shared_segment(&self->segment, name, size) != 0)
+        return 1;
+    memset(self->segment.data, 0, size - arena_size);
+    self->hdr = (pubsub_header_t *) self->segment.data;
+    self->hdr->entries = entries;
+    self->hdr->arena_size = arena_size;
+    pubsub_bind(self);
+    __atomic_store_n(&self->hdr->magic, PUBSUB_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static inline int
+open_pubsub(pubsub_t *self, const char *name)
+{
+    assert(self);
+    assert(name);
+    if (attach_shared_segment(&self->segment, name) != 0)
+        return 1;
+    self->hdr = (pubsub_header_t *) self->segment.data;
+    if (self->segment.size < sizeof(pubsub_header_t)
+        || __atomic_load_n(&self->hdr->magic, __ATOMIC_ACQUIRE) != PUBSUB_MAGIC
+        || pubsub_segment_size(self->hdr->entries, self->hdr->arena_size) > self->segment.size) {
+        detach_shared_segment(&self->segment);
+        return 1;
+    }
+    pubsub_bind(self);
+    return 0;
+}
+
+static inline void
+close_pubsub(const char *name)
+{
+    assert(name);
+    shm_unlink(name);
+}
+
+static inline uint64_t
+pubsub_union(pubsub_t *self)
+{
+    uint64_t topics = 0;
+    int i;
+    for (i = 0; i < PUBSUB_MAX_SUBS; ++i)
+        if (__atomic_load_n(&self->subs[i].state, __ATOMIC_SEQ_CST) == SubActive)
+            topics |= __atomic_load_n(&self->subs[i].topics, __ATOMIC_RELAXED);
+    return topics;
+}
+
+static inline void
+pubsub_refresh_interest(pubsub_t *self)
+{
+    /* a concurrent subscribe ORs its bits in after publishing its slot, so a stale union fails the CAS */
+    uint64_t old = __atomic_load_n(&self->hdr->interest, __ATOMIC_SEQ_CST), now;
+    do {
+        now = pubsub_union(self);
+    } while (!__atomic_compare_exchange_n(&self->hdr->interest, &old, now, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+}
+
+static inline unsigned
+pubsub_reap(pubsub_t *self)
+{
+    /* frees the slots of subscribers whose process no longer exists and drops their topics from `interest` */
+    unsigned reaped = 0;
+    uint32_t expected;
+    int i;
+    assert(self);
+    for (i = 0; i < PUBSUB_MAX_SUBS; ++i) {
+        expected = SubActive;
+        if (i != self->sub && __atomic_load_n(&self->subs[i].state, __ATOMIC_ACQUIRE) == SubActive
+            && self->subs[i].pid > 0 && kill(self->subs[i].pid, 0) != 0 && errno == ESRCH
+            && __atomic_compare_exchange_n(&self->subs[i].state, &expected, SubFree, 0,
+                                           __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            ++reaped;
+    }
+    if (reaped)
+        pubsub_refresh_interest(self);
+    return reaped;
+}
+
+static inline int
+pubsub_subscribe(pubsub_t *self, uint64_t topics)
+{
+    /* claims a subscriber slot; messages published from now on whose topic bit is set are delivered */
+    int i;
+    uint32_t expected;
+    assert(self);
+    if (self->sub != PUBSUB_NO_SUB) {
+        __atomic_store_n(&self->subs[self->sub].topics, topics, __ATOMIC_SEQ_CST);
+        pubsub_refresh_interest(self);
+        return 0;
+    }
+    for (i = 0; i < PUBSUB_MAX_SUBS; ++i) {
+        expected = SubFree;
+        if (__atomic_compare_exchange_n(&self->subs[i].state, &expected, SubClaimed, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+        if (i == PUBSUB_MAX_SUBS - 1 && pubsub_reap(self) != 0)
+            i = -1;             /* the table was full of dead subscribers: scan again */
+    }
+    if (i == PUBSUB_MAX_SUBS)
+        return 1;
+    self->subs[i].pid = (int32_t) getpid();
+    self->subs[i].topics = topics;
+    self->subs[i].delivered = 0;
+    self->subs[i].dropped = 0;
+    self->subs[i].expired = 0;
+    __atomic_store_n(&self->subs[i].state, SubActive, __ATOMIC_SEQ_CST);
+    __atomic_fetch_or(&self->hdr->interest, topics, __ATOMIC_SEQ_CST);
+    self->sub = i;
+    self->cursor = __atomic_load_n(&self->hdr->head, __ATOMIC_ACQUIRE);
+    return 0;
+}
+
+static inline void
+pubsub_unsubscribe(pubsub_t *self)
+{
+    assert(self);
+    if (self->sub == PUBSUB_NO_SUB)
+        return;
+    __atomic_store_n(&self->subs[self->sub].state, SubFree, __ATOMIC_SEQ_CST);
+    self->sub = PUBSUB_NO_SUB;
+    pubsub_refresh_interest(self);
+}
+
+static inline void
+detach_pubsub(pubsub_t *self)
+{
+    assert(self);
+    pubsub_unsubscribe(self);
+    detach_shared_segment(&self->segment);
+    self->hdr = NULL;
+}
+
+static inline uint64_t
+pubsub_reserve(pubsub_t *self, size_t len)
+{
+    /* reserves a contiguous arena range; a range that would straddle the end is skipped and retried */
+    uint64_t need = (len + PUBSUB_ALIGN - 1) & ~(uint64_t) (PUBSUB_ALIGN - 1), off;
+    for (;;) {
+        off = __atomic_fetch_add(&self->hdr->arena_tail, need, __ATOMIC_RELAXED);
+        if (off % self->hdr->arena_size + need <= self->hdr->arena_size)
+            return off;
+    }
+}
+
+static inline int
+pubsub_publish_deadline(pubsub_t *self, uint32_t topic, const void *data, size_t len, uint64_t deadline_ns)
+{
+    /* returns 0 when published or when no subscriber wants the topic, 1 if the message can never fit. */
+    /* Subscribers drop the message unread once monotonic_ns() passes deadline_ns (0: never). */
+    pubsub_entry_t *e;
+    uint64_t pos, off;
+    assert(self);
+    assert(topic < PUBSUB_TOPICS);
+    assert(data || len == 0);
+    if (len > self->hdr->arena_size / 4 || len > UINT32_MAX)
+        return 1;
+    if ((__atomic_load_n(&self->hdr->interest, __ATOMIC_RELAXED) & (1ull << topic)) == 0) {
+        __atomic_add_fetch(&self->hdr->filtered, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    pos = __atomic_fetch_add(&self->hdr->head, 1, __ATOMIC_RELAXED);
+    off = pubsub_reserve(self, len);
+    e = &self->entries[pos & self->mask];
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(self->arena + off % self->hdr->arena_size, data, len);
+    e->topic = topic;
+    e->len = (uint32_t) len;
+    e->off = off;
+    e->deadline = deadline_ns;
+    __atomic_store_n(&e->seq, pos + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&self->hdr->notify, 1, __ATOMIC_RELEASE);
+    notify_change(&self->hdr->notify, &self->hdr->waiters);
+    return 0;
+}
+
+static inline int
+pubsub_publish(pubsub_t *self, uint32_t topic, const void *data, size_t len)
+{
+    return pubsub_publish_deadline(self, topic, data, len, 0);
+}
+
+static inline int
+pubsub_publish_ttl(pubsub_t *self, uint32_t topic, const void *data, size_t len, uint64_t ttl_ns)
+{
+    /* the message expires ttl_ns after being published */
+    return pubsub_publish_deadline(self, topic, data, len, monotonic_ns() + ttl_ns);
+}
+
+static inline int
+pubsub_msg_valid(pubsub_t *self, const pubsub_msg_t *msg)
+{
+    /* 1 while the payload returned by pubsub_poll() cannot have been overwritten */
+    pubsub_entry_t *e = &self->entries[(msg->seq - 1) & self->mask];
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&e->seq, __ATOMIC_RELAXED) == msg->seq
+           && __atomic_load_n(&self->hdr->arena_tail, __ATOMIC_RELAXED) - msg->off <= self->hdr->arena_size;
+}
+
+static inline int
+pubsub_poll(pubsub_t *self, pubsub_msg_t *msg)
+{
+    /* returns 0 with the next message for this subscriber's topics (not copied), 1 if there is none yet */
+    pubsub_sub_t *sub;
+    uint64_t head, seq, topics, now = 0;
+    assert(self);
+    assert(msg);
+    assert(self->sub != PUBSUB_NO_SUB);
+    sub = &self->subs[self->sub];
+    topics = sub->topics;
+    head = __atomic_load_n(&self->hdr->head, __ATOMIC_ACQUIRE);
+    if (head - self->cursor > self->hdr->entries) {
+        /* lapped: everything older than one ring is gone */
+        __atomic_add_fetch(&sub->dropped, head - self->hdr->entries - self->cursor, __ATOMIC_RELAXED);
+        self->cursor = head - self->hdr->entries;
+    }
+    while (self->cursor != head) {
+        pubsub_entry_t *e = &self->entries[self->cursor & self->mask];
+        seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if (seq != self->cursor + 1) {
+            if (seq > self->cursor + 1) {
+                /* overwritten by a publisher one lap ahead */
+                __atomic_add_fetch(&sub->dropped, 1, __ATOMIC_RELAXED);
+                ++self->cursor;
+                continue;
+            }
+            /* reserved but not yet published: keep order and retry later, unless the publisher died */
+            if (self->stall_since == 0 || self->stall_pos != self->cursor) {
+                self->stall_pos = self->cursor;
+                self->stall_since = monotonic_ns();
+                return 1;
+            }
+            if (monotonic_ns() - self->stall_since < PUBSUB_STALL_NS)
+                return 1;
+            __atomic_add_fetch(&sub->dropped, 1, __ATOMIC_RELAXED);
+            ++self->cursor;
+            continue;
+        }
+        ++self->cursor;
+        if ((topics & (1ull << e->topic)) == 0)
+            continue;
+        if (e->deadline != 0) {
+            if (now == 0)
+                now = monotonic_ns();
+            if (now > e->deadline) {
+                __atomic_add_fetch(&sub->expired, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+        }
+        msg->seq = seq;
+        msg->topic = e->topic;
+        msg->len = e->len;
+        msg->off = e->off;
+        msg->data = self->arena + msg->off % self->hdr->arena_size;
+        if (!pubsub_msg_valid(self, msg)) {
+            __atomic_add_fetch(&sub->dropped, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        __atomic_add_fetch(&sub->delivered, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+static inline int
+pubsub_recv(pubsub_t *self, uint32_t *topic, void *buf, size_t cap, size_t *len, uint64_t timeout_ns)
+{
+    /* waits (per policy) for the next message and copies it; 1 on timeout or if cap is too small (skipped) */
+    pubsub_msg_t msg;
+    uint32_t seen;
+    uint64_t deadline = timeout_ns ? monotonic_ns() + timeout_ns : 0, now, slice;
+    assert(buf);
+    assert(len);
+    for (;;) {
+        seen = __atomic_load_n(&self->hdr->notify, __ATOMIC_ACQUIRE);
+        while (pubsub_poll(self, &msg) == 0) {
+            if (msg.len > cap)
+                return 1;
+            memcpy(buf, msg.data, msg.len);
+            if (!pubsub_msg_valid(self, &msg)) {
+                __atomic_add_fetch(&self->subs[self->sub].dropped, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            if (topic)
+                *topic = msg.topic;
+            *len = msg.len;
+            return 0;
+        }
+        slice = 0;
+        if (deadline != 0) {
+            now = monotonic_ns();
+            if (now >= deadline)
+                return 1;
+            slice = deadline - now;
+        }
+        /* stopped at an unpublished entry: come back to skip it even if nothing else is published */
+        if (self->stall_since != 0 && self->stall_pos == self->cursor && (slice == 0 || slice > PUBSUB_STALL_NS))
+            slice = PUBSUB_STALL_NS;
+        wait_for_change(&self->hdr->notify, seen, &self->hdr->waiters, &self->policy, slice);
+    }
+}
+
+#endif //P2PMD_SHM_PUBSUB_H
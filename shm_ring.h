@@ -0,0 +1,444 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ */
+
+#ifndef P2PMD_SHM_RING_H
+#define P2PMD_SHM_RING_H
+
+#include <stdint.h>
+#include <string.h>
+#include "shm_segment.h"
+#include "shm_wait.h"
+
+/***************************************************************************************************************\
+|*  Submission/completion ring pair                                                                            *|
+|***************************************************************************************************************|
+|*  One client process submits fixed-size requests (SQEs) into the submission ring; one server process        *|
+|*  consumes them and posts fixed-size results (CQEs) into the completion ring. Each ring is single-producer   *|
+|*  single-consumer, indices are free-running 32-bit counters masked by (entries - 1):                         *|
+|*    SQ: client owns sq_tail, server owns sq_head     CQ: server owns cq_tail, client owns cq_head            *|
+|*  A producer fills slots [tail, tail+n) privately and publishes them with one release store of tail, so a    *|
+|*  batch of SQEs costs a single index update and at most one wakeup. The consumer acquires tail, reads the    *|
+|*  slots and releases head. Empty: head == tail. Full: tail - head == entries.                                *|
+|*  Both sides poll first and sleep on the index word only after `policy.spins` (see shm_wait.h), so an       *|
+|*  active pair never enters the kernel.                                                                       *|
+|*                                                                                                             *|
+|*  Payloads that do not fit the 32 inline bytes of an SQE go into the buffer area, addressed by index. The   *|
+|*  client owns the buffers: a buffer must not be reused until the CQE for the request naming it arrived.     *|
+|*                                                                                                             *|
+|*  Submission is credit-based. The server grants the client `sq_window` (at most sq_entries) SQEs in flight  *|
+|*  and publishes the resulting limit, sq_credit = sq_head + sq_window, whenever it consumes; ring_get_sqe()   *|
+|*  hands out slots only below that limit. The client can read its credits at any time and shed or slow down  *|
+|*  before it would stall, wait for a number of credits, or register a callback that fires when credits come  *|
+|*  back after it ran out. The server narrows the window to push back on a client before the ring is full.    *|
+\***************************************************************************************************************/
+
+/************************************************************\
+|* Ring segment layout                                      *|
+|************************************************************|
+|* 1) ring_header_t (indices on separate cache lines)       *|
+|* 2) ring_sqe_t sqes[sq_entries]                           *|
+|* 3) ring_cqe_t cqes[cq_entries]                           *|
+|* 4) char buffers[buf_count][buf_size]                     *|
+\************************************************************/
+
+#define RING_MAGIC 0x52494e47u
+#define RING_CACHELINE 64
+#define RING_INLINE_BYTES 32
+#define RING_NO_BUFFER 0xffffffffu
+
+typedef struct _ring_sqe {
+    uint64_t user_data;
+    uint32_t opcode;
+    uint32_t flags;
+    uint64_t off;
+    uint32_t len;
+    uint32_t buf;
+    unsigned char inline_data[RING_INLINE_BYTES];
+} ring_sqe_t;
+
+typedef struct _ring_cqe {
+    uint64_t user_data;
+    int32_t res;
+    uint32_t flags;
+} ring_cqe_t;
+
+typedef struct _ring_index {
+    volatile uint32_t value;
+    volatile uint32_t waiters;
+    char pad[RING_CACHELINE - 2 * sizeof(uint32_t)];
+} ring_index_t;
+
+typedef struct _ring_header {
+    volatile uint32_t magic;
+    uint32_t sq_entries;
+    uint32_t cq_entries;
+    uint32_t buf_count;
+    uint64_t buf_size;
+    uint64_t total_size;
+    volatile uint32_t sq_window;
+    char pad[RING_CACHELINE - 5 * sizeof(uint32_t) - 2 * sizeof(uint64_t)];
+    ring_index_t sq_head;
+    ring_index_t sq_tail;
+    ring_index_t sq_credit;
+    ring_index_t cq_head;
+    ring_index_t cq_tail;
+} ring_header_t;
+
+struct _ring;
+/* called by the client with its credits once they reach the registered threshold after running out */
+typedef void (*ring_credit_fn)(struct _ring *ring, unsigned credits, void *arg);
+
+typedef struct _ring {
+    shared_segment_t segment;
+    ring_header_t *hdr;
+    ring_sqe_t *sqes;
+    ring_cqe_t *cqes;
+    char *buffers;
+    uint32_t sq_mask;
+    uint32_t cq_mask;
+    uint32_t sq_local_tail;     /* client: slots handed out by ring_get_sqe() but not yet submitted */
+    uint32_t cq_local_tail;     /* server: CQEs written but not yet published */
+    wait_policy_t policy;
+    ring_credit_fn credit_fn;   /* client: see ring_on_credits() */
+    void *credit_arg;
+    unsigned credit_threshold;
+    int credit_starved;         /* client: ring_get_sqe() ran out of credits since the callback last fired */
+    uint64_t credit_stalls;     /* client: ring_get_sqe() calls refused for lack of credits */
+} ring_t;
+
+static inline size_t
+ring_segment_size(uint32_t sq_entries, uint32_t cq_entries, uint32_t buf_count, size_t buf_size)
+{
+    return sizeof(ring_header_t) + sizeof(ring_sqe_t) * sq_entries + sizeof(ring_cqe_t) * cq_entries
+           + (size_t) buf_count * buf_size;
+}
+
+static inline void
+ring_bind(ring_t *self)
+{
+    char *base = (char *) self->segment.data;
+    self->hdr = (ring_header_t *) base;
+    self->sqes = (ring_sqe_t *) (base + sizeof(ring_header_t));
+    self->cqes = (ring_cqe_t *) ((char *) self->sqes + sizeof(ring_sqe_t) * self->hdr->sq_entries);
+    self->buffers = (char *) self->cqes + sizeof(ring_cqe_t) * self->hdr->cq_entries;
+    self->sq_mask = self->hdr->sq_entries - 1;
+    self->cq_mask = self->hdr->cq_entries - 1;
+    self->sq_local_tail = self->hdr->sq_tail.value;
+    self->cq_local_tail = self->hdr->cq_tail.value;
+    self->policy.mode = WaitAdaptive;
+    self->policy.spins = WAIT_DEFAULT_SPINS;
+    self->credit_fn = NULL;
+    self->credit_arg = NULL;
+    self->credit_threshold = 0;
+    self->credit_starved = 0;
+    self->credit_stalls = 0;
+}
+
+static inline int
+create_ring(ring_t *self, const char *name, uint32_t sq_entries, uint32_t cq_entries,
+            uint32_t buf_count, size_t buf_size)
+{
+    /* precondition: entries are powers of two; the server side creates the ring */
+    /* postcondition: both rings empty, header published with magic last */
+    size_t size;
+    assert(self);
+    assert(name);
+    assert(sq_entries > 0 && (sq_entries & (sq_entries - 1)) == 0);
+    assert(cq_entries > 0 && (cq_entries & (cq_entries - 1)) == 0);
+    size = ring_segment_size(sq_entries, cq_entries, buf_count, buf_size);
+    if (map_shared_segment(&self->segment, name, size) != 0)
+        return 1;
+    memset(self->segment.data, 0, sizeof(ring_header_t));
+    self->hdr = (ring_header_t *) self->segment.data;
+    self->hdr->sq_entries = sq_entries;
+    self->hdr->cq_entries = cq_entries;
+    self->hdr->buf_count = buf_count;
+    self->hdr->buf_size = buf_size;
+    self->hdr->total_size = size;
+    self->hdr->sq_window = sq_entries;
+    self->hdr->sq_credit.value = sq_entries;
+    ring_bind(self);
+    __atomic_store_n(&self->hdr->magic, RING_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static inline int
+open_ring(ring_t *self, const char *name)
+{
+    /* precondition: create_ring() has completed in the server */
+    assert(self);
+    assert(name);
+    if (attach_shared_segment(&self->segment, name) != 0)
+        return 1;
+    self->hdr = (ring_header_t *) self->segment.data;
+    /* ring_bind() masks with the entry counts and places the arrays by them: check them against the mapping */
+    if (self->segment.size < sizeof(ring_header_t)
+        || __atomic_load_n(&self->hdr->magic, __ATOMIC_ACQUIRE) != RING_MAGIC
+        || self->hdr->sq_entries == 0 || (self->hdr->sq_entries & (self->hdr->sq_entries - 1)) != 0
+        || self->hdr->cq_entries == 0 || (self->hdr->cq_entries & (self->hdr->cq_entries - 1)) != 0
+        || (self->hdr->buf_count != 0 && self->hdr->buf_size > self->segment.size / self->hdr->buf_count)
+        || ring_segment_size(self->hdr->sq_entries, self->hdr->cq_entries, self->hdr->buf_count,
+                             self->hdr->buf_size) > self->segment.size) {
+        detach_shared_segment(&self->segment);
+        return 1;
+    }
+    ring_bind(self);
+    return 0;
+}
+
+static inline void
+detach_ring(ring_t *self)
+{
+    assert(self);
+    detach_shared_segment(&self->segment);
+    self->hdr = NULL;
+}
+
+static inline void
+close_ring(const char *name)
+{
+    assert(name);
+    shm_unlink(name);
+}
+
+static inline void *
+ring_buffer(ring_t *self, uint32_t index)
+{
+    assert(self);
+    if (index >= self->hdr->buf_count)
+        return NULL;
+    return self->buffers + (size_t) index * self->hdr->buf_size;
+}
+
+/* client side */
+
+static inline ring_sqe_t *
+ring_get_sqe(ring_t *self)
+{
+    /* returns the next free SQE, or NULL if the client is out of credits (the ring is full at the latest) */
+    uint32_t limit = __atomic_load_n(&self->hdr->sq_credit.value, __ATOMIC_ACQUIRE);
+    ring_sqe_t *sqe;
+    if ((int32_t) (limit - self->sq_local_tail) <= 0) {
+        self->credit_starved = 1;
+        ++self->credit_stalls;
+        return NULL;
+    }
+    sqe = &self->sqes[self->sq_local_tail & self->sq_mask];
+    ++self->sq_local_tail;
+    sqe->flags = 0;
+    sqe->buf = RING_NO_BUFFER;
+    return sqe;
+}
+
+static inline unsigned
+ring_submit(ring_t *self)
+{
+    /* publishes every SQE obtained since the last submit with a single tail store */
+    uint32_t tail = self->hdr->sq_tail.value;
+    unsigned n = self->sq_local_tail - tail;
+    if (n == 0)
+        return 0;
+    __atomic_store_n(&self->hdr->sq_tail.value, self->sq_local_tail, __ATOMIC_RELEASE);
+    notify_change(&self->hdr->sq_tail.value, &self->hdr->sq_tail.waiters);
+    return n;
+}
+
+static inline unsigned
+ring_sq_credits(ring_t *self)
+{
+    /* SQEs ring_get_sqe() will hand out before the server consumes more */
+    int32_t credits = (int32_t) (__atomic_load_n(&self->hdr->sq_credit.value, __ATOMIC_ACQUIRE)
+                                 - self->sq_local_tail);
+    return credits > 0 ? (unsigned) credits : 0;
+}
+
+static inline unsigned
+ring_sq_pending(ring_t *self)
+{
+    /* SQEs submitted but not yet consumed: how far behind the server is */
+    return __atomic_load_n(&self->hdr->sq_tail.value, __ATOMIC_ACQUIRE)
+           - __atomic_load_n(&self->hdr->sq_head.value, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+ring_on_credits(ring_t *self, unsigned threshold, ring_credit_fn fn, void *arg)
+{
+    /* fn (NULL to unregister) runs from ring_poll_credits()/ring_wait_credits() once ring_get_sqe() has run */
+    /* out and at least `threshold` credits are available again; it runs in the client, never in the server */
+    assert(self);
+    self->credit_fn = fn;
+    self->credit_arg = arg;
+    self->credit_threshold = threshold ? threshold : 1;
+}
+
+static inline unsigned
+ring_poll_credits(ring_t *self)
+{
+    /* returns the current credits, firing the credit callback if it is due */
+    unsigned credits = ring_sq_credits(self);
+    if (self->credit_starved && credits >= self->credit_threshold) {
+        self->credit_starved = 0;
+        if (self->credit_fn)
+            self->credit_fn(self, credits, self->credit_arg);
+    }
+    return credits;
+}
+
+static inline int
+ring_wait_credits(ring_t *self, unsigned n, uint64_t timeout_ns)
+{
+    /* returns 0 once at least n credits are available, 1 on timeout or if n exceeds the ring */
+    uint32_t limit;
+    assert(n > 0);
+    if (n > self->hdr->sq_entries)
+        return 1;
+    while (ring_poll_credits(self) < n) {
+        limit = __atomic_load_n(&self->hdr->sq_credit.value, __ATOMIC_ACQUIRE);
+        if ((int32_t) (limit - self->sq_local_tail) >= (int32_t) n)
+            continue;
+        if (wait_for_change(&self->hdr->sq_credit.value, limit, &self->hdr->sq_credit.waiters,
+                            &self->policy, timeout_ns) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+static inline ring_cqe_t *
+ring_peek_cqe(ring_t *self)
+{
+    uint32_t head = self->hdr->cq_head.value;
+    if (__atomic_load_n(&self->hdr->cq_tail.value, __ATOMIC_ACQUIRE) == head)
+        return NULL;
+    return &self->cqes[head & self->cq_mask];
+}
+
+static inline int
+ring_wait_cqe(ring_t *self, ring_cqe_t **cqe, uint64_t timeout_ns)
+{
+    /* returns 0 with *cqe set, 1 on timeout */
+    uint32_t head = self->hdr->cq_head.value;
+    assert(cqe);
+    while ((*cqe = ring_peek_cqe(self)) == NULL) {
+        if (wait_for_change(&self->hdr->cq_tail.value, head, &self->hdr->cq_tail.waiters,
+                            &self->policy, timeout_ns) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+static inline void
+ring_cqe_seen(ring_t *self, unsigned n)
+{
+    __atomic_store_n(&self->hdr->cq_head.value, self->hdr->cq_head.value + n, __ATOMIC_RELEASE);
+    notify_change(&self->hdr->cq_head.value, &self->hdr->cq_head.waiters);
+}
+
+/* server side */
+
+static inline unsigned
+ring_peek_sqes(ring_t *self, ring_sqe_t **first)
+{
+    /* returns how many SQEs are ready; *first is the oldest. Entries may wrap: index with ring_sqe_at() */
+    uint32_t head = self->hdr->sq_head.value;
+    unsigned n = __atomic_load_n(&self->hdr->sq_tail.value, __ATOMIC_ACQUIRE) - head;
+    if (first)
+        *first = n ? &self->sqes[head & self->sq_mask] : NULL;
+    return n;
+}
+
+static inline ring_sqe_t *
+ring_sqe_at(ring_t *self, unsigned i)
+{
+    return &self->sqes[(self->hdr->sq_head.value + i) & self->sq_mask];
+}
+
+static inline int
+ring_wait_sqes(ring_t *self, uint64_t timeout_ns)
+{
+    /* returns 0 once at least one SQE is ready, 1 on timeout */
+    uint32_t head = self->hdr->sq_head.value;
+    while (ring_peek_sqes(self, NULL) == 0) {
+        if (wait_for_change(&self->hdr->sq_tail.value, head, &self->hdr->sq_tail.waiters,
+                            &self->policy, timeout_ns) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+static inline void
+ring_grant_credits(ring_t *self)
+{
+    uint32_t head = self->hdr->sq_head.value;
+    __atomic_store_n(&self->hdr->sq_credit.value, head + self->hdr->sq_window, __ATOMIC_RELEASE);
+    notify_change(&self->hdr->sq_credit.value, &self->hdr->sq_credit.waiters);
+}
+
+static inline void
+ring_consume_sqes(ring_t *self, unsigned n)
+{
+    /* frees the slots and returns their credits to the client */
+    __atomic_store_n(&self->hdr->sq_head.value, self->hdr->sq_head.value + n, __ATOMIC_RELEASE);
+    notify_change(&self->hdr->sq_head.value, &self->hdr->sq_head.waiters);
+    ring_grant_credits(self);
+}
+
+static inline int
+ring_set_sq_window(ring_t *self, uint32_t window)
+{
+    /* limits the client to `window` SQEs in flight (1..sq_entries). SQEs already obtained stay valid when */
+    /* the window narrows; the client simply gets no new ones until it is back under the limit. */
+    assert(self);
+    if (window == 0 || window > self->hdr->sq_entries)
+        return 1;
+    __atomic_store_n(&self->hdr->sq_window, window, __ATOMIC_RELEASE);
+    ring_grant_credits(self);
+    return 0;
+}
+
+static inline int
+ring_prep_cqe(ring_t *self, uint64_t user_data, int32_t res, uint32_t flags)
+{
+    /* stages one CQE; returns 1 if the completion ring is full (the client is not reaping) */
+    uint32_t head = __atomic_load_n(&self->hdr->cq_head.value, __ATOMIC_ACQUIRE);
+    ring_cqe_t *cqe;
+    if (self->cq_local_tail - head >= self->hdr->cq_entries)
+        return 1;
+    cqe = &self->cqes[self->cq_local_tail & self->cq_mask];
+    cqe->user_data = user_data;
+    cqe->res = res;
+    cqe->flags = flags;
+    ++self->cq_local_tail;
+    return 0;
+}
+
+static inline unsigned
+ring_flush_cqes(ring_t *self)
+{
+    uint32_t tail = self->hdr->cq_tail.value;
+    unsigned n = self->cq_local_tail - tail;
+    if (n == 0)
+        return 0;
+    __atomic_store_n(&self->hdr->cq_tail.value, self->cq_local_tail, __ATOMIC_RELEASE);
+    notify_change(&self->hdr->cq_tail.value, &self->hdr->cq_tail.waiters);
+    return n;
+}
+
+static inline int
+ring_post_cqe(ring_t *self, uint64_t user_data, int32_t res, uint32_t flags)
+{
+    /* blocks (per policy) while the completion ring is full, then publishes one CQE */
+    uint32_t head;
+    while (ring_prep_cqe(self, user_data, res, flags) != 0) {
+        head = __atomic_load_n(&self->hdr->cq_head.value, __ATOMIC_ACQUIRE);
+        if (self->cq_local_tail - head < self->hdr->cq_entries)
+            continue;
+        wait_for_change(&self->hdr->cq_head.value, head, &self->hdr->cq_head.waiters, &self->policy, 0);
+    }
+    ring_flush_cqes(self);
+    return 0;
+}
+
+#endif //P2PMD_SHM_RING_H
@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ */
+
+#ifndef P2PMD_SHM_RT_H
+#define P2PMD_SHM_RT_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include "shm_segment.h"
+
+/***************************************************************************************************************\
+|*  Opt-in real-time profile for latency-critical threads                                                      *|
+|***************************************************************************************************************|
+|*  rt_enter() prepares the calling thread for a low-jitter channel loop:                                      *|
+|*    - pins it to one CPU, by default the first CPU listed in /sys/devices/system/cpu/isolated (isolcpus=),   *|
+|*      so the scheduler and most interrupts stay away from it;                                                *|
+|*    - mlockall(MCL_CURRENT | MCL_FUTURE) so no page of the process, segments included, is faulted in or      *|
+|*      out on the hot path;                                                                                   *|
+|*    - touches `stack_bytes` of stack so the pages the loop will use are already mapped;                      *|
+|*    - switches it to SCHED_FIFO at `fifo_priority` (needs CAP_SYS_NICE or an RLIMIT_RTPRIO allowance). This  *|
+|*      comes last so the slow locking and prefaulting do not run at real-time priority and starve the other   *|
+|*      threads on that CPU.                                                                                   *|
+|*  Each step that cannot be applied is skipped rather than treated as fatal. rt_verify() reads the settings   *|
+|*  back from the kernel and reports which ones are actually in effect, so a service can log or refuse a       *|
+|*  degraded configuration at startup. rt_lock_segment() locks and prefaults a single mapping for processes    *|
+|*  that do not want mlockall().                                                                               *|
+|*                                                                                                             *|
+|*  Affinity goes through the raw syscalls, so this header does not need _GNU_SOURCE. Everything except the    *|
+|*  mlock calls is Linux-only; elsewhere those steps simply report failure.                                    *|
+\***************************************************************************************************************/
+
+#define RT_MAX_CPUS 1024
+#define RT_CPU_ISOLATED (-1)
+#define RT_CPU_NONE (-2)
+#define RT_DEFAULT_PRIORITY 50
+#define RT_DEFAULT_STACK (256 * 1024)
+#define RT_ISOLATED_PATH "/sys/devices/system/cpu/isolated"
+
+typedef enum _rt_feature {
+    RtPinned = 0x1, RtIsolated = 0x2, RtFifo = 0x4, RtLocked = 0x8, RtStack = 0x10
+} rt_feature_t;
+
+typedef struct _rt_cpuset {
+    uint64_t bits[RT_MAX_CPUS / 64];
+} rt_cpuset_t;
+
+typedef struct _rt_profile {
+    int cpu;                    /* CPU to pin to, RT_CPU_ISOLATED for the first isolated CPU, RT_CPU_NONE to skip */
+    int fifo_priority;          /* SCHED_FIFO priority, 0 to keep the current policy */
+    int lock_memory;            /* mlockall() the process */
+    size_t stack_bytes;         /* stack to prefault, 0 to skip */
+} rt_profile_t;
+
+static inline void
+rt_default_profile(rt_profile_t *profile)
+{
+    assert(profile);
+    profile->cpu = RT_CPU_ISOLATED;
+    profile->fifo_priority = RT_DEFAULT_PRIORITY;
+    profile->lock_memory = 1;
+    profile->stack_bytes = RT_DEFAULT_STACK;
+}
+
+static inline int
+rt_cpu_isset(const rt_cpuset_t *set, int cpu)
+{
+    return cpu >= 0 && cpu < RT_MAX_CPUS && (set->bits[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+static inline int
+rt_parse_cpulist(const char *s, rt_cpuset_t *set)
+{
+    /* parses the kernel's cpulist format ("0-3,8,10-11"); returns 1 on malformed input */
+    char *end;
+    long lo, hi;
+    assert(s);
+    assert(set);
+    memset(set, 0, sizeof(*set));
+    while (*s && *s != '\n') {
+        lo = hi = strtol(s, &end, 10);
+        if (end == s)
+            return 1;
+        s = end;
+        if (*s == '-') {
+            hi = strtol(s + 1, &end, 10);
+            if (end == s + 1)
+                return 1;
+            s = end;
+        }
+        if (lo < 0 || hi < lo || hi >= RT_MAX_CPUS)
+            return 1;
+        for (; lo <= hi; ++lo)
+            set->bits[lo / 64] |= 1ull << (lo % 64);
+        if (*s == ',')
+            ++s;
+    }
+    return 0;
+}
+
+static inline int
+rt_isolated_cpus(rt_cpuset_t *set)
+{
+    /* reads the isolcpus= set; an empty set (no isolated CPUs) is not an error */
+    char buf[4096];
+    FILE *f;
+    assert(set);
+    memset(set, 0, sizeof(*set));
+    f = fopen(RT_ISOLATED_PATH, "r");
+    if (f == NULL)
+        return 1;
+    if (fgets(buf, sizeof(buf), f) == NULL)
+        buf[0] = '\0';
+    fclose(f);
+    return rt_parse_cpulist(buf, set);
+}
+
+static inline int
+rt_first_cpu(const rt_cpuset_t *set)
+{
+    int cpu;
+    for (cpu = 0; cpu < RT_MAX_CPUS; ++cpu)
+        if (rt_cpu_isset(set, cpu))
+            return cpu;
+    return -1;
+}
+
+static inline int
+rt_get_affinity(rt_cpuset_t *set)
+{
+    assert(set);
+    memset(set, 0, sizeof(*set));
+#ifdef __linux__
+    return syscall(SYS_sched_getaffinity, 0, sizeof(set->bits), set->bits) < 0 ? 1 : 0;
+#else
+    return 1;
+#endif
+}
+
+static inline int
+rt_pin_cpu(int cpu)
+{
+    /* pins the calling thread to one CPU */
+#ifdef __linux__
+    rt_cpuset_t set;
+    if (cpu < 0 || cpu >= RT_MAX_CPUS)
+        return 1;
+    memset(&set, 0, sizeof(set));
+    set.bits[cpu / 64] = 1ull << (cpu % 64);
+    return syscall(SYS_sched_setaffinity, 0, sizeof(set.bits), set.bits) != 0 ? 1 : 0;
+#else
+    (void) cpu;
+    return 1;
+#endif
+}
+
+static inline int
+rt_set_fifo(int priority)
+{
+    /* SCHED_FIFO for the calling thread; fails with EPERM without CAP_SYS_NICE / RLIMIT_RTPRIO */
+#ifdef __linux__
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    return sched_setscheduler(0, SCHED_FIFO, &param) != 0 ? 1 : 0;
+#else
+    (void) priority;
+    return 1;
+#endif
+}
+
+static __attribute__((noinline, unused)) void
+rt_prefault_stack(size_t bytes)
+{
+    /* maps `bytes` of stack below the caller's frame now instead of on first use in the hot loop */
+    volatile char *stack = (volatile char *) __builtin_alloca(bytes);
+    size_t i;
+    long page = sysconf(_SC_PAGESIZE);
+    for (i = 0; i < bytes; i += (size_t) page)
+        stack[i] = 0;
+}
+
+static inline int
+rt_lock_segment(shared_segment_t *segment)
+{
+    /* locks a mapping in RAM; mlock() also faults in every page, so the first access never faults */
+    assert(segment);
+    return mlock(segment->data, segment->size) != 0 ? 1 : 0;
+}
+
+static inline unsigned
+rt_verify(void)
+{
+    /* returns the rt_feature_t bits the kernel reports for the calling thread (RtStack cannot be checked) */
+    rt_cpuset_t affinity, isolated;
+    unsigned got = 0;
+    int cpu = -1, n = 0, i;
+    char line[256];
+    FILE *f;
+    if (rt_get_affinity(&affinity) == 0) {
+        for (i = 0; i < RT_MAX_CPUS; ++i)
+            if (rt_cpu_isset(&affinity, i)) {
+                cpu = i;
+                ++n;
+            }
+        if (n == 1)
+            got |= RtPinned;
+        if (n == 1 && rt_isolated_cpus(&isolated) == 0 && rt_cpu_isset(&isolated, cpu))
+            got |= RtIsolated;
+    }
+#ifdef __linux__
+    if (sched_getscheduler(0) == SCHED_FIFO)
+        got |= RtFifo;
+#endif
+    f = fopen("/proc/self/status", "r");
+    if (f != NULL) {
+        while (fgets(line, sizeof(line), f) != NULL)
+            if (strncmp(line, "VmLck:", 6) == 0 && strtoul(line + 6, NULL, 10) > 0)
+                got |= RtLocked;
+        fclose(f);
+    }
+    return got;
+}
+
+static inline unsigned
+rt_wanted(const rt_profile_t *profile)
+{
+    unsigned want = 0;
+    if (profile->cpu != RT_CPU_NONE)
+        want |= RtPinned;
+    if (profile->cpu == RT_CPU_ISOLATED)
+        want |= RtIsolated;
+    if (profile->fifo_priority > 0)
+        want |= RtFifo;
+    if (profile->lock_memory)
+        want |= RtLocked;
+    if (profile->stack_bytes > 0)
+        want |= RtStack;
+    return want;
+}
+
+static inline int
+rt_enter(const rt_profile_t *profile, unsigned *achieved)
+{
+    /* applies the profile to the calling thread; returns 0 iff every requested feature is in effect.
+     * achieved (may be NULL) receives the rt_feature_t bits that are. */
+    rt_cpuset_t isolated;
+    unsigned got;
+    int cpu;
+    assert(profile);
+    cpu = profile->cpu;
+    if (cpu == RT_CPU_ISOLATED)
+        cpu = rt_isolated_cpus(&isolated) == 0 ? rt_first_cpu(&isolated) : -1;
+    if (cpu >= 0)
+        rt_pin_cpu(cpu);
+    if (profile->lock_memory)
+        mlockall(MCL_CURRENT | MCL_FUTURE);
+    if (profile->stack_bytes > 0)
+        rt_prefault_stack(profile->stack_bytes);
+    /* last, so the setup above does not run at real-time priority */
+    if (profile->fifo_priority > 0)
+        rt_set_fifo(profile->fifo_priority);
+    got = rt_verify();
+    if (profile->stack_bytes > 0)
+        got |= RtStack;
+    if (achieved)
+        *achieved = got;
+    return (got & rt_wanted(profile)) == rt_wanted(profile) ? 0 : 1;
+}
+
+static inline void
+rt_describe(unsigned features, char *buf, size_t size)
+{
+    /* "pinned,isolated,fifo,locked,stack" style summary for startup logs */
+    assert(buf);
+    snprintf(buf, size, "%s%s%s%s%s",
+             features & RtPinned ? "pinned," : "", features & RtIsolated ? "isolated," : "",
+             features & RtFifo ? "fifo," : "", features & RtLocked ? "locked," : "",
+             features & RtStack ? "stack," : "");
+    if (buf[0] == '\0')
+        snprintf(buf, size, "none");
+    else
+        buf[strlen(buf) - 1] = '\0';
+}
+
+#endif //P2PMD_SHM_RT_H
@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ */
+
+#ifndef P2PMD_SHM_SCHEMA_HPP
+#define P2PMD_SHM_SCHEMA_HPP
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include "shared_memory.h"
+#include "shm_stream.h"
+
+/***************************************************************************************************************\
+|*  Zero-copy message schemas (C++17)                                                                          *|
+|***************************************************************************************************************|
+|*  A schema is a list of fields: shm::field<T> for a fixed trivially copyable value, shm::vec<T> for a        *|
+|*  variable-length array of T and shm::str for a string. The offset of every fixed field is computed at       *|
+|*  compile time; variable-length fields are stored after the fixed part and referenced by (offset, count).    *|
+|*                                                                                                             *|
+|*      using quote = shm::schema<shm::field<uint64_t>, shm::field<double>, shm::str, shm::vec<int32_t>>;      *|
+|*      enum { Ts, Px, Sym, Levels };                                                                          *|
+|*                                                                                                             *|
+|*  shm::builder writes a message directly into a buffer - typically space from stream_claim() - and           *|
+|*  shm::view reads one where it lies: open() checks the schema fingerprint and length once, get<I>() returns  *|
+|*  fixed fields by value and variable fields as a span / string_view that is checked against the message      *|
+|*  bounds (an out-of-bounds reference reads as empty). Nothing is parsed or copied on the consumer side.      *|
+|*  Both sides must use the same schema; the fingerprint catches most mismatches, not all.                     *|
+\***************************************************************************************************************/
+
+/************************************************************\
+|* Schema message layout                                    *|
+|************************************************************|
+|* 1) uint32_t fingerprint of the schema                    *|
+|* 2) uint32_t total length                                 *|
+|* 3) fixed fields at schema::offsets[i]; variable fields   *|
+|*    as shm::var_ref {offset, count}                       *|
+|* 4) variable-length data, each aligned for its element    *|
+\************************************************************/
+
+namespace shm {
+
+enum field_kind : uint32_t {
+    FieldFixed = 1, FieldVector = 2, FieldString = 3
+};
+
+struct var_ref {
+    uint32_t off;
+    uint32_t count;
+};
+
+template <typename T>
+struct field {
+    static_assert(std::is_trivially_copyable<T>::value, "fixed fields must be trivially copyable");
+    using value_type = T;
+    static constexpr uint32_t kind = FieldFixed;
+    static constexpr size_t size = sizeof(T);
+    static constexpr size_t align = alignof(T);
+};
+
+template <typename T>
+struct vec {
+    static_assert(std::is_trivially_copyable<T>::value, "vector elements must be trivially copyable");
+    using value_type = T;
+    static constexpr uint32_t kind = FieldVector;
+    static constexpr size_t size = sizeof(var_ref);
+    static constexpr size_t align = alignof(var_ref);
+};
+
+struct str {
+    using value_type = char;
+    static constexpr uint32_t kind = FieldString;
+    static constexpr size_t size = sizeof(var_ref);
+    static constexpr size_t align = alignof(var_ref);
+};
+
+template <typename T>
+class span {
+public:
+    constexpr span() : data_(nullptr), size_(0) {}
+    constexpr span(const T *data, size_t size) : data_(data), size_(size) {}
+    const T *data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    const T *begin() const { return data_; }
+    const T *end() const { return data_ + size_; }
+    const T &operator[](size_t i) const
+    {
+        assert(i < size_);
+        return data_[i];
+    }
+private:
+    const T *data_;
+    size_t size_;
+};
+
+constexpr size_t
+align_up(size_t off, size_t align)
+{
+    return (off + align - 1) / align * align;
+}
+
+template <typename... F>
+struct schema {
+    static constexpr size_t count = sizeof...(F);
+    static constexpr size_t header_size = 2 * sizeof(uint32_t);
+
+    template <size_t I>
+    using field_t = typename std::tuple_element<I, std::tuple<F...>>::type;
+
+    static constexpr std::array<size_t, count>
+    compute_offsets()
+    {
+        std::array<size_t, count> out{};
+        const size_t sizes[] = {F::size..., 0};
+        const size_t aligns[] = {F::align..., 1};
+        size_t off = header_size;
+        for (size_t i = 0; i < count; ++i) {
+            off = align_up(off, aligns[i]);
+            out[i] = off;
+            off += sizes[i];
+        }
+        return out;
+    }
+
+    static constexpr size_t
+    compute_fixed_size()
+    {
+        const size_t sizes[] = {F::size..., 0};
+        return count == 0 ? header_size : align_up(compute_offsets()[count - 1] + sizes[count - 1], 8);
+    }
+
+    static constexpr uint32_t
+    compute_fingerprint()
+    {
+        /* FNV-1a over the kind, slot size and element size of every field */
+        const uint32_t words[] = {F::kind..., static_cast<uint32_t>(F::size)...,
+                                  static_cast<uint32_t>(sizeof(typename F::value_type))..., 0};
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < 3 * count; ++i) {
+            h ^= words[i];
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    static constexpr std::array<size_t, count> offsets = compute_offsets();
+    static constexpr size_t fixed_size = compute_fixed_size();
+    static constexpr uint32_t fingerprint = compute_fingerprint();
+};
+
+template <typename S>
+class builder {
+public:
+    builder(void *buf, size_t cap) : base_(static_cast<char *>(buf)), cap_(cap), used_(S::fixed_size),
+                                     ok_(buf != nullptr && cap >= S::fixed_size)
+    {
+        if (ok_) {
+            uint32_t fp = S::fingerprint;
+            std::memset(base_, 0, S::fixed_size);
+            std::memcpy(base_, &fp, sizeof(fp));
+        }
+    }
+
+    template <size_t I>
+    void
+    set(const typename S::template field_t<I>::value_type &value)
+    {
+        static_assert(S::template field_t<I>::kind == FieldFixed, "set(value) is for fixed fields");
+        if (ok_)
+            std::memcpy(base_ + S::offsets[I], &value, sizeof(value));
+    }
+
+    template <size_t I>
+    typename S::template field_t<I>::value_type *
+    alloc(size_t n)
+    {
+        /* reserves n elements of a variable field and returns them for filling in place, nullptr if full */
+        using T = typename S::template field_t<I>::value_type;
+        static_assert(S::template field_t<I>::kind != FieldFixed, "alloc() is for vector and string fields");
+        size_t off = align_up(used_, alignof(T));
+        var_ref ref;
+        if (!ok_ || n > (cap_ - std::min(off, cap_)) / sizeof(T) || off + n * sizeof(T) > UINT32_MAX) {
+            ok_ = false;
+            return nullptr;
+        }
+        ref.off = static_cast<uint32_t>(off);
+        ref.count = static_cast<uint32_t>(n);
+        std::memcpy(base_ + S::offsets[I], &ref, sizeof(ref));
+        used_ = off + n * sizeof(T);
+        return reinterpret_cast<T *>(base_ + off);
+    }
+
+    template <size_t I>
+    bool
+    set(const typename S::template field_t<I>::value_type *data, size_t n)
+    {
+        auto *dst = alloc<I>(n);
+        if (dst == nullptr)
+            return false;
+        std::memcpy(static_cast<void *>(dst), data, n * sizeof(*data));
+        return true;
+    }
+
+    template <size_t I>
+    bool
+    set(std::string_view s)
+    {
+        static_assert(S::template field_t<I>::kind == FieldString, "set(string_view) is for string fields");
+        return set<I>(s.data(), s.size());
+    }
+
+    size_t
+    finish()
+    {
+        /* stamps the total length; returns it, or 0 if anything did not fit */
+        uint32_t len = static_cast<uint32_t>(used_);
+        if (!ok_ || used_ > UINT32_MAX)
+            return 0;
+        std::memcpy(base_ + sizeof(uint32_t), &len, sizeof(len));
+        return used_;
+    }
+
+    bool ok() const { return ok_; }
+    char *data() const { return base_; }
+
+private:
+    char *base_;
+    size_t cap_;
+    size_t used_;
+    bool ok_;
+};
+
+template <typename S>
+class view {
+public:
+    view() : base_(nullptr), len_(0) {}
+
+    bool
+    open(const void *data, size_t len)
+    {
+        /* validates the header; on success every get<I>() is safe */
+        uint32_t fp, total;
+        base_ = nullptr;
+        if (data == nullptr || len < S::fixed_size || reinterpret_cast<uintptr_t>(data) % 8 != 0)
+            return false;
+        std::memcpy(&fp, data, sizeof(fp));
+        std::memcpy(&total, static_cast<const char *>(data) + sizeof(uint32_t), sizeof(total));
+        if (fp != S::fingerprint || total < S::fixed_size || total > len)
+            return false;
+        base_ = static_cast<const char *>(data);
+        len_ = total;
+        return true;
+    }
+
+    template <size_t I>
+    auto
+    get() const
+    {
+        using F = typename S::template field_t<I>;
+        using T = typename F::value_type;
+        assert(base_ != nullptr);
+        if constexpr (F::kind == FieldFixed) {
+            T value;
+            std::memcpy(&value, base_ + S::offsets[I], sizeof(T));
+            return value;
+        } else {
+            var_ref ref;
+            std::memcpy(&ref, base_ + S::offsets[I], sizeof(ref));
+            bool fits = ref.off >= S::fixed_size && ref.off <= len_ && ref.count <= (len_ - ref.off) / sizeof(T)
+                        && ref.off % alignof(T) == 0;
+            if constexpr (F::kind == FieldString)
+                return fits ? std::string_view(base_ + ref.off, ref.count) : std::string_view();
+            else
+                return fits ? span<T>(reinterpret_cast<const T *>(base_ + ref.off), ref.count) : span<T>();
+        }
+    }
+
+    size_t size() const { return len_; }
+
+private:
+    const char *base_;
+    size_t len_;
+};
+
+template <typename S>
+inline builder<S>
+claim(stream_t *stream, size_t cap)
+{
+    /* a builder writing straight into the stream's data area; publish() makes it visible */
+    return builder<S>(stream_claim(stream, cap), cap);
+}
+
+template <typename S>
+inline int
+publish(stream_t *stream, builder<S> &b, uint64_t *offset = nullptr)
+{
+    size_t len = b.finish();
+    if (len == 0)
+        return 1;
+    stream_publish(stream, len, offset);
+    return 0;
+}
+
+template <typename S>
+inline int
+send(shared_memory_t *shm, builder<S> &b)
+{
+    /* sends a message built in a private buffer over a send_item/recv_item channel */
+    size_t len = b.finish();
+    return len == 0 ? 1 : send_item(shm, b.data(), len);
+}
+
+} // namespace shm
+
+#endif //P2PMD_SHM_SCHEMA_HPP
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ */
+
+#ifndef P2PMD_SHM_SEGMENT_H
+#define P2PMD_SHM_SEGMENT_H
+
+#include <assert.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+
+/************************************************************\
+|* Raw shared memory segments                               *|
+|************************************************************|
+|* The shm_open + ftruncate + mmap sequence used by         *|
+|* create_shared_memory(), factored out so the ring, log    *|
+|* and table headers can map segments of their own size.    *|
+|* ftruncate() is only allowed once on Darwin, so EINVAL    *|
+|* from a second ftruncate is tolerated exactly like the    *|
+|* original code does.                                      *|
+\************************************************************/
+
+#ifndef _MODE
+#define _MODE 0777
+#endif
+
+typedef struct _shared_segment {
+    int fd;
+    void *data;
+    size_t size;
+} shared_segment_t;
+
+static inline int
+map_shared_segment(shared_segment_t *self, const char *name, size_t size)
+{
+    /* creates the segment if it does not exist; maps exactly `size` bytes */
+    assert(self);
+    assert(name);
+    assert(size > 0);
+    self->fd = shm_open(name, O_CREAT | O_RDWR, _MODE);
+    if (self->fd < 0) {
+        shm_unlink(name);
+        return 1;
+    }
+    if (ftruncate(self->fd, (off_t) size) < 0) {
+        if (errno == EINVAL) goto ftruncate_failed_but_einval;
+        close(self->fd);
+        shm_unlink(name);
+        return 1;
+    }
+ftruncate_failed_but_einval:
+    self->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, self->fd, 0);
+    if (self->data == MAP_FAILED) {
+        close(self->fd);
+        shm_unlink(name);
+        return 1;
+    }
+    self->size = size;
+    return 0;
+}
+
+static inline int
+attach_shared_segment(shared_segment_t *self, const char *name)
+{
+    /* precondition: the segment exists and has been sized by its creator */
+    /* postcondition: the whole segment is mapped, size taken from fstat() */
+    struct stat st;
+    assert(self);
+    assert(name);
+    self->fd = shm_open(name, O_RDWR, _MODE);
+    if (self->fd < 0) {
+        return 1;
+    }
+    if (fstat(self->fd, &st) < 0 || st.st_size <= 0) {
+        close(self->fd);
+        return 1;
+    }
+    self->data = mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, self->fd, 0);
+    if (self->data == MAP_FAILED) {
+        close(self->fd);
+        return 1;
+    }
+    self->size = (size_t) st.st_size;
+    return 0;
+}
+
+static inline void
+detach_shared_segment(shared_segment_t *self)
+{
+    assert(self);
+    if (self->data != NULL && self->data != MAP_FAILED)
+        munmap(self->data, self->size);
+    if (self->fd >= 0)
+        close(self->fd);
+    self->data = NULL;
+    self->fd = -1;
+    self->size = 0;
+}
+
+#endif //P2PMD_SHM_SEGMENT_H
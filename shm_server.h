@@ -0,0 +1,423 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ */
+
+#ifndef P2PMD_SHM_SERVER_H
+#define P2PMD_SHM_SERVER_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include "shm_ring.h"
+
+/***************************************************************************************************************\
+|*  Shared-memory server with per-client channels                                                              *|
+|***************************************************************************************************************|
+|*  The server creates a registry segment holding one slot per potential client. A client claims a free slot  *|
+|*  with a CAS (Free -> Claimed), records its pid, moves it to Requested and rings the doorbell. The server    *|
+|*  thread owning that slot (slot % threads) creates the client's SQ/CQ ring "<name>.c<slot>" and moves the    *|
+|*  slot to Ready; the client then opens the ring and talks to it like any shm_ring.h client.                  *|
+|*                                                                                                             *|
+|*  Each server thread round-robins over the slots it owns, draining SQEs into the handler. After a pass with  *|
+|*  no work it backs off (growing TPAUSE or PAUSE bursts, then sched_yield) and finally sleeps on the doorbell.*|
+|*  The doorbell uses the same handshake as shm_wait.h, but the word is a sequence counter clients bump only   *|
+|*  when a server thread is asleep:                                                                            *|
+|*    server:  seq = doorbell ; sleepers++ ; fence ; rescan ; if idle: futex_wait(doorbell, seq)              *|
+|*    client:  sq_tail = t    ; fence      ; if (sleepers) { doorbell++ ; futex_wake(doorbell) }               *|
+|*  A running server is therefore never signalled and a client never makes a system call while it is busy.     *|
+|*                                                                                                             *|
+|*  A client whose completion ring is full is skipped: its remaining SQEs stay queued until it reaps, so one   *|
+|*  stalled client never holds up the others on the same thread. A Closing slot is released on the next pass   *|
+|*  over it, discarding any SQEs that did not fit in its completion ring. Every SERVER_CHECK_NS a thread also  *|
+|*  checks the pids of its clients and releases the ring of any client that died without disconnecting.        *|
+|*                                                                                                             *|
+|*  Slot states: Free -> Claimed -> Requested -> Ready -> Closing -> Free                                      *|
+\***************************************************************************************************************/
+
+#define SERVER_MAGIC 0x53525652u
+#define SERVER_NAME_MAX 64
+#define SERVER_IDLE_PASSES 64
+#define SERVER_MAX_BACKOFF 1024
+#define SERVER_PAUSE_CYCLES 100
+#define SERVER_SLEEP_NS 100000000ull
+#define SERVER_CHECK_NS 100000000ull
+
+typedef enum _slot_state {
+    SlotFree = 0, SlotClaimed = 1, SlotRequested = 2, SlotReady = 3, SlotClosing = 4
+} slot_state_t;
+
+typedef struct _server_slot {
+    volatile uint32_t state;
+    volatile uint32_t waiters;
+    volatile int32_t pid;
+    uint32_t generation;
+    char pad[RING_CACHELINE - 4 * sizeof(uint32_t)];
+} server_slot_t;
+
+typedef struct _server_header {
+    volatile uint32_t magic;
+    uint32_t max_clients;
+    uint32_t sq_entries;
+    uint32_t cq_entries;
+    uint32_t buf_count;
+    uint32_t pad0;
+    uint64_t buf_size;
+    char pad1[RING_CACHELINE - 6 * sizeof(uint32_t) - sizeof(uint64_t)];
+    ring_index_t doorbell;      /* value = sequence, waiters = sleeping server threads */
+} server_header_t;
+
+typedef int32_t (*server_handler_t)(void *arg, unsigned client, ring_t *ring, const ring_sqe_t *sqe);
+
+struct _server;
+
+typedef struct _server_thread {
+    struct _server *server;
+    pthread_t tid;
+    unsigned index;
+    unsigned *clients;          /* slots with a live ring, owned by this thread */
+    unsigned nclients;
+    uint64_t next_check;        /* when to look for clients that died */
+} server_thread_t;
+
+typedef struct _server {
+    shared_segment_t segment;
+    server_header_t *hdr;
+    server_slot_t *slots;
+    ring_t *rings;
+    server_thread_t *threads;
+    unsigned nthreads;
+    server_handler_t handler;
+    void *arg;
+    volatile int stop;
+    char name[SERVER_NAME_MAX];
+} server_t;
+
+typedef struct _server_client {
+    shared_segment_t segment;
+    server_header_t *hdr;
+    server_slot_t *slot;
+    unsigned index;
+    ring_t ring;
+} server_client_t;
+
+static inline void
+server_ring_name(char *out, size_t len, const char *name, unsigned slot)
+{
+    snprintf(out, len, "%s.c%u", name, slot);
+}
+
+static inline void
+server_ring_doorbell(server_header_t *hdr)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hdr->doorbell.waiters, __ATOMIC_RELAXED) != 0) {
+        __atomic_add_fetch(&hdr->doorbell.value, 1, __ATOMIC_SEQ_CST);
+        futex_wake_word(&hdr->doorbell.value, 0x7fffffff);
+    }
+}
+
+static inline int
+server_accept(server_t *self, server_thread_t *t, unsigned slot)
+{
+    /* Requested -> Ready: create the client's ring and add it to the owning thread */
+    char rname[SERVER_NAME_MAX + 16];
+    server_ring_name(rname, sizeof(rname), self->name, slot);
+    if (create_ring(&self->rings[slot], rname, self->hdr->sq_entries, self->hdr->cq_entries,
+                    self->hdr->buf_count, self->hdr->buf_size) != 0)
+        return 1;
+    t->clients[t->nclients++] = slot;
+    __atomic_store_n(&self->slots[slot].state, SlotReady, __ATOMIC_RELEASE);
+    notify_change(&self->slots[slot].state, &self->slots[slot].waiters);
+    return 0;
+}
+
+static inline void
+server_release(server_t *self, server_thread_t *t, unsigned pos)
+{
+    /* Closing -> Free: drop the ring and compact the thread's client list */
+    char rname[SERVER_NAME_MAX + 16];
+    unsigned slot = t->clients[pos];
+    detach_ring(&self->rings[slot]);
+    server_ring_name(rname, sizeof(rname), self->name, slot);
+    close_ring(rname);
+    t->clients[pos] = t->clients[--t->nclients];
+    self->slots[slot].pid = 0;
+    ++self->slots[slot].generation;
+    __atomic_store_n(&self->slots[slot].state, SlotFree, __ATOMIC_RELEASE);
+    notify_change(&self->slots[slot].state, &self->slots[slot].waiters);
+}
+
+static inline unsigned
+server_cq_space(ring_t *ring)
+{
+    uint32_t head = __atomic_load_n(&ring->hdr->cq_head.value, __ATOMIC_ACQUIRE);
+    return ring->hdr->cq_entries - (ring->cq_local_tail - head);
+}
+
+static inline int
+server_pid_gone(int32_t pid)
+{
+    /* a client that is our own child stays visible to kill() until it is reaped, so ask waitid() as well */
+    siginfo_t info;
+    if (kill(pid, 0) != 0 && errno == ESRCH)
+        return 1;
+    memset(&info, 0, sizeof(info));
+    return waitid(P_PID, (id_t) pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == pid;
+}
+
+static inline unsigned
+server_pass(server_t *self, server_thread_t *t)
+{
+    /* one round over the registrations and rings owned by this thread; returns the work done */
+    unsigned work = 0, i, j, n, space, slot;
+    uint64_t now = monotonic_ns();
+    int check = now >= t->next_check;
+    if (check)
+        t->next_check = now + SERVER_CHECK_NS;
+    for (slot = t->index; slot < self->hdr->max_clients; slot += self->nthreads) {
+        if (__atomic_load_n(&self->slots[slot].state, __ATOMIC_ACQUIRE) == SlotRequested) {
+            if (server_accept(self, t, slot) == 0)
+                ++work;
+        }
+    }
+    for (i = 0; i < t->nclients; ++i) {
+        ring_t *ring = &self->rings[t->clients[i]];
+        server_slot_t *s = &self->slots[t->clients[i]];
+        if (check && s->pid > 0 && server_pid_gone(s->pid)) {
+            /* the client died without disconnecting */
+            server_release(self, t, i--);
+            ++work;
+            continue;
+        }
+        n = ring_peek_sqes(ring, NULL);
+        space = server_cq_space(ring);
+        if (n > space)
+            n = space;          /* completion ring full: the rest stays queued until the client reaps */
+        for (j = 0; j < n; ++j) {
+            const ring_sqe_t *sqe = ring_sqe_at(ring, j);
+            ring_prep_cqe(ring, sqe->user_data, self->handler(self->arg, t->clients[i], ring, sqe), 0);
+        }
+        if (n != 0) {
+            ring_consume_sqes(ring, n);
+            ring_flush_cqes(ring);
+            work += n;
+        }
+        if (__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) == SlotClosing) {
+            /* a disconnected client no longer reaps: whatever did not fit in its CQ is discarded */
+            server_release(self, t, i--);
+            ++work;
+        }
+    }
+    return work;
+}
+
+static inline void *
+server_thread_main(void *p)
+{
+    server_thread_t *t = (server_thread_t *) p;
+    server_t *self = t->server;
+    server_header_t *hdr = self->hdr;
+    unsigned idle = 0, backoff = 1;
+    while (!__atomic_load_n(&self->stop, __ATOMIC_ACQUIRE)) {
+        uint32_t seq;
+        if (server_pass(self, t) != 0) {
+            idle = 0;
+            backoff = 1;
+            continue;
+        }
+        if (++idle < SERVER_IDLE_PASSES) {
+            cpu_pause_cycles((uint64_t) backoff * SERVER_PAUSE_CYCLES);
+            if (backoff < SERVER_MAX_BACKOFF)
+                backoff <<= 1;
+            else
+                sched_yield();
+            continue;
+        }
+        /* idle: announce ourselves as a sleeper, rescan once, then sleep on the doorbell */
+        seq = __atomic_load_n(&hdr->doorbell.value, __ATOMIC_ACQUIRE);
+        __atomic_add_fetch(&hdr->doorbell.waiters, 1, __ATOMIC_SEQ_CST);
+        if (server_pass(self, t) == 0 && !__atomic_load_n(&self->stop, __ATOMIC_ACQUIRE))
+            futex_wait_word(&hdr->doorbell.value, seq, SERVER_SLEEP_NS);
+        __atomic_sub_fetch(&hdr->doorbell.waiters, 1, __ATOMIC_SEQ_CST);
+        idle = 0;
+        backoff = 1;
+    }
+    return NULL;
+}
+
+static inline int
+create_server(server_t *self, const char *name, unsigned max_clients, unsigned nthreads,
+              uint32_t sq_entries, uint32_t cq_entries, uint32_t buf_count, size_t buf_size,
+              server_handler_t handler, void *arg)
+{
+    /* postcondition: registry published, no threads running yet (see start_server) */
+    size_t size;
+    unsigned i;
+    assert(self);
+    assert(name && strlen(name) < SERVER_NAME_MAX);
+    assert(max_clients > 0);
+    assert(nthreads > 0);
+    assert(handler);
+    memset(self, 0, sizeof(*self));
+    strcpy(self->name, name);
+    self->nthreads = nthreads;
+    self->handler = handler;
+    self->arg = arg;
+    size = sizeof(server_header_t) + sizeof(server_slot_t) * max_clients;
+    if (map_shared_segment(&self->segment, name, size) != 0)
+        return 1;
+    memset(self->segment.data, 0, size);
+    self->hdr = (server_header_t *) self->segment.data;
+    self->slots = (server_slot_t *) ((char *) self->segment.data + sizeof(server_header_t));
+    self->hdr->max_clients = max_clients;
+    self->hdr->sq_entries = sq_entries;
+    self->hdr->cq_entries = cq_entries;
+    self->hdr->buf_count = buf_count;
+    self->hdr->buf_size = buf_size;
+    self->rings = (ring_t *) calloc(max_clients, sizeof(ring_t));
+    self->threads = (server_thread_t *) calloc(nthreads, sizeof(server_thread_t));
+    if (self->rings == NULL || self->threads == NULL)
+        goto create_server_failed;
+    for (i = 0; i < nthreads; ++i) {
+        self->threads[i].server = self;
+        self->threads[i].index = i;
+        self->threads[i].clients = (unsigned *) calloc(max_clients / nthreads + 1, sizeof(unsigned));
+        if (self->threads[i].clients == NULL)
+            goto create_server_failed;
+    }
+    __atomic_store_n(&self->hdr->magic, SERVER_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+create_server_failed:
+    if (self->threads)
+        for (i = 0; i < nthreads; ++i)
+            free(self->threads[i].clients);
+    free(self->threads);
+    free(self->rings);
+    detach_shared_segment(&self->segment);
+    shm_unlink(name);
+    return 1;
+}
+
+static inline int
+start_server(server_t *self)
+{
+    unsigned i;
+    assert(self);
+    for (i = 0; i < self->nthreads; ++i) {
+        if (pthread_create(&self->threads[i].tid, NULL, server_thread_main, &self->threads[i]) != 0) {
+            self->nthreads = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static inline void
+stop_server(server_t *self)
+{
+    /* joins the threads, drops every client ring and unlinks the registry */
+    char rname[SERVER_NAME_MAX + 16];
+    unsigned i, j;
+    assert(self);
+    __atomic_store_n(&self->stop, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&self->hdr->doorbell.value, 1, __ATOMIC_SEQ_CST);
+    futex_wake_word(&self->hdr->doorbell.value, 0x7fffffff);
+    for (i = 0; i < self->nthreads; ++i) {
+        server_thread_t *t = &self->threads[i];
+        pthread_join(t->tid, NULL);
+        for (j = 0; j < t->nclients; ++j) {
+            detach_ring(&self->rings[t->clients[j]]);
+            server_ring_name(rname, sizeof(rname), self->name, t->clients[j]);
+            close_ring(rname);
+        }
+        free(t->clients);
+    }
+    free(self->threads);
+    free(self->rings);
+    detach_shared_segment(&self->segment);
+    shm_unlink(self->name);
+}
+
+/* client side */
+
+static inline int
+connect_server(server_client_t *self, const char *name, uint64_t timeout_ns)
+{
+    /* claims a registry slot and waits for the server to set up its ring; 1 if full or timed out */
+    char rname[SERVER_NAME_MAX + 16];
+    unsigned i;
+    assert(self);
+    assert(name);
+    if (attach_shared_segment(&self->segment, name) != 0)
+        return 1;
+    self->hdr = (server_header_t *) self->segment.data;
+    if (__atomic_load_n(&self->hdr->magic, __ATOMIC_ACQUIRE) != SERVER_MAGIC)
+        goto connect_server_failed;
+    self->slot = NULL;
+    for (i = 0; i < self->hdr->max_clients; ++i) {
+        server_slot_t *s = (server_slot_t *) ((char *) self->segment.data + sizeof(server_header_t)) + i;
+        uint32_t expected = SlotFree;
+        if (__atomic_compare_exchange_n(&s->state, &expected, SlotClaimed, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            self->slot = s;
+            self->index = i;
+            break;
+        }
+    }
+    if (self->slot == NULL)
+        goto connect_server_failed;
+    self->slot->pid = (int32_t) getpid();
+    __atomic_store_n(&self->slot->state, SlotRequested, __ATOMIC_RELEASE);
+    server_ring_doorbell(self->hdr);
+    while (__atomic_load_n(&self->slot->state, __ATOMIC_ACQUIRE) == SlotRequested) {
+        wait_policy_t policy = {WaitBlock, 0};
+        if (wait_for_change(&self->slot->state, SlotRequested, &self->slot->waiters, &policy, timeout_ns) != 0) {
+            /* withdraw the request; if the server accepted it meanwhile, have it released instead */
+            uint32_t expected = SlotRequested;
+            if (!__atomic_compare_exchange_n(&self->slot->state, &expected, SlotFree, 0,
+                                             __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&self->slot->state, SlotClosing, __ATOMIC_RELEASE);
+                server_ring_doorbell(self->hdr);
+            }
+            goto connect_server_failed;
+        }
+    }
+    server_ring_name(rname, sizeof(rname), name, self->index);
+    if (open_ring(&self->ring, rname) != 0) {
+        /* the server holds a ring for this slot: have it released */
+        __atomic_store_n(&self->slot->state, SlotClosing, __ATOMIC_RELEASE);
+        server_ring_doorbell(self->hdr);
+        goto connect_server_failed;
+    }
+    return 0;
+connect_server_failed:
+    detach_shared_segment(&self->segment);
+    return 1;
+}
+
+static inline unsigned
+client_submit(server_client_t *self)
+{
+    unsigned n = ring_submit(&self->ring);
+    if (n != 0)
+        server_ring_doorbell(self->hdr);
+    return n;
+}
+
+static inline void
+disconnect_server(server_client_t *self)
+{
+    assert(self);
+    detach_ring(&self->ring);
+    __atomic_store_n(&self->slot->state, SlotClosing, __ATOMIC_RELEASE);
+    server_ring_doorbell(self->hdr);
+    detach_shared_segment(&self->segment);
+}
+
+#endif //P2PMD_SHM_SERVER_H
@@ -0,0 +1,456 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ */
+
+#ifndef P2PMD_SHM_STREAM_H
+#define P2PMD_SHM_STREAM_H
+
+#include <stdint.h>
+#include <string.h>
+#include "shm_segment.h"
+#include "shm_wait.h"
+
+/***************************************************************************************************************\
+|*  Retained append-only log with consumer groups                                                              *|
+|***************************************************************************************************************|
+|*  One producer appends records; every record gets a 64-bit offset (0, 1, 2, ...). Records stay in the log    *|
+|*  after they are read and are only dropped by retention: when the data area or the index is full, when the   *|
+|*  retained bytes exceed `retain_bytes`, or when the oldest record is older than `retain_ns` (0 disables      *|
+|*  either limit). `first` is the oldest retained offset and `next` the offset the next append gets.           *|
+|*                                                                                                             *|
+|*  Consumers read at their own offset and never modify the log, so any number of them can follow it, late     *|
+|*  joiners can start from `first` and anyone can seek back to replay. A consumer group is a named committed   *|
+|*  offset in the segment: a consumer joining a group resumes from what the group last committed.              *|
+|*                                                                                                             *|
+|*  The producer advances `first` before it reuses the space of an evicted record, so a reader validates a     *|
+|*  record by checking, after it has used the bytes, that its offset is still >= `first`. stream_peek()        *|
+|*  returns a pointer straight into the data area; stream_valid() performs that check afterwards.              *|
+|*  Producers that build a record in place use stream_claim(), which returns cache-line aligned space in the   *|
+|*  data area, and stream_publish() once the record is written.                                                *|
+\***************************************************************************************************************/
+
+/************************************************************\
+|* Stream segment layout                                    *|
+|************************************************************|
+|* 1) stream_header_t (producer counters on own lines)      *|
+|* 2) stream_group_t groups[STREAM_MAX_GROUPS]              *|
+|* 3) stream_index_t index[entries]                         *|
+|* 4) char data[capacity], cache-line aligned               *|
+\************************************************************/
+
+#define STREAM_MAGIC 0x5354524du
+#define STREAM_MAX_GROUPS 32
+#define STREAM_GROUP_NAME 48
+#define STREAM_ALIGN 8
+#define STREAM_CACHELINE 64
+#define STREAM_FROM_EARLIEST 0
+#define STREAM_FROM_LATEST UINT64_MAX
+
+typedef enum _stream_group_state {
+    GroupFree = 0, GroupNaming = 1, GroupActive = 2
+} stream_group_state_t;
+
+typedef struct _stream_index {
+    volatile uint64_t seq;      /* offset + 1 once the record is complete */
+    uint64_t pos;               /* logical byte position, data[pos % capacity] */
+    uint64_t ts;
+    uint64_t len;
+} stream_index_t;
+
+typedef struct _stream_group {
+    volatile uint32_t state;
+    char name[STREAM_GROUP_NAME];
+    uint32_t pad;
+    volatile uint64_t committed;
+} stream_group_t;
+
+typedef struct _stream_header {
+    volatile uint32_t magic;
+    uint32_t entries;
+    uint64_t capacity;
+    volatile uint64_t retain_bytes;
+    volatile uint64_t retain_ns;
+    char pad0[STREAM_CACHELINE - 2 * sizeof(uint32_t) - 3 * sizeof(uint64_t)];
+    volatile uint64_t first;
+    volatile uint64_t next;
+    volatile uint64_t tail;
+    char pad1[STREAM_CACHELINE - 3 * sizeof(uint64_t)];
+    volatile uint32_t notify;
+    volatile uint32_t waiters;
+    char pad2[STREAM_CACHELINE - 2 * sizeof(uint32_t)];
+} stream_header_t;
+
+typedef struct _stream_record {
+    uint64_t offset;
+    uint64_t ts;
+    size_t len;
+    const void *data;
+} stream_record_t;
+
+typedef struct _stream {
+    shared_segment_t segment;
+    stream_header_t *hdr;
+    stream_group_t *groups;
+    stream_index_t *index;
+    char *data;
+    uint64_t mask;
+    wait_policy_t policy;
+    uint64_t claim_pos;         /* producer: logical position and time of the record being written */
+    uint64_t claim_ts;
+} stream_t;
+
+typedef struct _stream_consumer {
+    stream_t *stream;
+    int group;                  /* index into groups, -1 for an anonymous consumer */
+    uint64_t offset;            /* next offset this consumer reads */
+    uint64_t skipped;           /* records lost to retention before this consumer reached them */
+} stream_consumer_t;
+
+static inline size_t
+stream_data_offset(uint32_t entries)
+{
+    /* the data area starts on a cache line so that stream_claim() alignment holds in absolute terms */
+    size_t off = sizeof(stream_header_t) + sizeof(stream_group_t) * STREAM_MAX_GROUPS
+                 + sizeof(stream_index_t) * entries;
+    return (off + STREAM_CACHELINE - 1) & ~(size_t) (STREAM_CACHELINE - 1);
+}
+
+static inline size_t
+stream_segment_size(uint32_t entries, size_t capacity)
+{
+    return stream_data_offset(entries) + capacity;
+}
+
+static inline void
+stream_bind(stream_t *self)
+{
+    char *base = (char *) self->segment.data;
+    self->hdr = (stream_header_t *) base;
+    self->groups = (stream_group_t *) (base + sizeof(stream_header_t));
+    self->index = (stream_index_t *) (self->groups + STREAM_MAX_GROUPS);
+    self->data = base + stream_data_offset(self->hdr->entries);
+    self->mask = self->hdr->entries - 1;
+    self->policy.mode = WaitAdaptive;
+    self->policy.spins = WAIT_DEFAULT_SPINS;
+}
+
+static inline int
+create_stream(stream_t *self, const char *name, uint32_t entries, size_t capacity,
+              uint64_t retain_bytes, uint64_t retain_ns)
+{
+    /* precondition: entries is a power of two, capacity a multiple of STREAM_ALIGN */
+    size_t size;
+    assert(self);
+    assert(name);
+    assert(entries > 0 && (entries & (entries - 1)) == 0);
+    assert(capacity > 0 && capacity % STREAM_ALIGN == 0);
+    size = stream_segment_size(entries, capacity);
+    if (map_shared_segment(&self->segment, name, size) != 0)
+        return 1;
+    memset(self->segment.data, 0, size - capacity);
+    self->hdr = (stream_header_t *) self->segment.data;
+    self->hdr->entries = entries;
+    self->hdr->capacity = capacity;
+    self->hdr->retain_bytes = retain_bytes;
+    self->hdr->retain_ns = retain_ns;
+    stream_bind(self);
+    __atomic_store_n(&self->hdr->magic, STREAM_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static inline int
+open_stream(stream_t *self, const char *name)
+{
+    assert(self);
+    assert(name);
+    if (attach_shared_segment(&self->segment, name) != 0)
+        return 1;
+    self->hdr = (stream_header_t *) self->segment.data;
+    if (self->segment.size < sizeof(stream_header_t)
+        || __atomic_load_n(&self->hdr->magic, __ATOMIC_ACQUIRE) != STREAM_MAGIC
+        || stream_segment_size(self->hdr->entries, self->hdr->capacity) > self->segment.size) {
+        detach_shared_segment(&self->segment);
+        return 1;
+    }
+    stream_bind(self);
+    return 0;
+}
+
+static inline void
+detach_stream(stream_t *self)
+{
+    assert(self);
+    detach_shared_segment(&self->segment);
+    self->hdr = NULL;
+}
+
+static inline void
+close_stream(const char *name)
+{
+    assert(name);
+    shm_unlink(name);
+}
+
+/* producer side (one producer per stream) */
+
+static inline int
+stream_expired(stream_t *self, uint64_t first, uint64_t end, uint64_t now)
+{
+    /* would retention drop record `first` if the log ended at logical byte `end`? */
+    stream_index_t *e = &self->index[first & self->mask];
+    if (end - e->pos > self->hdr->capacity)
+        return 1;
+    if (self->hdr->retain_bytes != 0 && end - e->pos > self->hdr->retain_bytes)
+        return 1;
+    return self->hdr->retain_ns != 0 && now - e->ts > self->hdr->retain_ns;
+}
+
+static inline void
+stream_evict(stream_t *self, uint64_t end, uint64_t now, uint64_t keep_slots)
+{
+    uint64_t first = self->hdr->first, next = self->hdr->next;
+    while (first < next && (next - first > keep_slots || stream_expired(self, first, end, now)))
+        ++first;
+    /* release: readers that see the new `first` stop trusting the space before it is reused */
+    __atomic_store_n(&self->hdr->first, first, __ATOMIC_RELEASE);
+}
+
+static inline void
+stream_trim(stream_t *self)
+{
+    /* applies age retention without appending; call periodically if the producer may go idle */
+    assert(self);
+    stream_evict(self, self->hdr->tail, monotonic_ns(), self->hdr->entries);
+}
+
+static inline char *
+stream_reserve(stream_t *self, size_t len, uint64_t align)
+{
+    /* evicts room for len bytes at the next `align` boundary of the data area and returns where they go */
+    uint64_t need = (len + STREAM_ALIGN - 1) & ~(uint64_t) (STREAM_ALIGN - 1);
+    uint64_t pos = self->hdr->tail, phys, pad;
+    stream_index_t *e;
+    if (need + align - STREAM_ALIGN > self->hdr->capacity / 2
+        || (self->hdr->retain_bytes != 0 && need > self->hdr->retain_bytes))
+        return NULL;
+    phys = pos % self->hdr->capacity;
+    pad = (align - phys % align) % align;
+    if (phys + pad + need > self->hdr->capacity)
+        pos += self->hdr->capacity - phys;  /* records are contiguous: skip the tail, offset 0 is aligned */
+    else
+        pos += pad;
+    self->claim_ts = monotonic_ns();
+    stream_evict(self, pos + need, self->claim_ts, self->hdr->entries - 1);
+    e = &self->index[self->hdr->next & self->mask];
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    self->claim_pos = pos;
+    return self->data + pos % self->hdr->capacity;
+}
+
+static inline void *
+stream_claim(stream_t *self, size_t max_len)
+{
+    /* returns STREAM_CACHELINE aligned space for a record of up to max_len bytes, NULL if it can never fit. */
+    /* Nothing is visible to consumers until stream_publish(). */
+    assert(self);
+    return stream_reserve(self, max_len, STREAM_CACHELINE);
+}
+
+static inline void
+stream_publish(stream_t *self, size_t len, uint64_t *offset)
+{
+    /* publishes the claimed record with its final length (at most the claimed one). offset may be NULL */
+    uint64_t next = self->hdr->next;
+    stream_index_t *e = &self->index[next & self->mask];
+    assert(self);
+    e->pos = self->claim_pos;
+    e->ts = self->claim_ts;
+    e->len = len;
+    __atomic_store_n(&e->seq, next + 1, __ATOMIC_RELEASE);
+    self->hdr->tail = self->claim_pos + ((len + STREAM_ALIGN - 1) & ~(uint64_t) (STREAM_ALIGN - 1));
+    __atomic_store_n(&self->hdr->next, next + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&self->hdr->notify, 1, __ATOMIC_RELEASE);
+    notify_change(&self->hdr->notify, &self->hdr->waiters);
+    if (offset)
+        *offset = next;
+}
+
+static inline int
+stream_append(stream_t *self, const void *data, size_t len, uint64_t *offset)
+{
+    /* appends one record, evicting the oldest as needed; returns 1 if len can never fit. offset may be NULL */
+    char *dst;
+    assert(self);
+    assert(data || len == 0);
+    dst = stream_reserve(self, len, STREAM_ALIGN);
+    if (dst == NULL)
+        return 1;
+    memcpy(dst, data, len);
+    stream_publish(self, len, offset);
+    return 0;
+}
+
+/* consumer side */
+
+static inline int
+stream_join(stream_t *self, stream_consumer_t *c, const char *group, uint64_t from)
+{
+    /* joins (creating it if needed) a consumer group, or an anonymous consumer when group is NULL.
+     * A new group, or an anonymous consumer, starts at `from`: an offset, STREAM_FROM_EARLIEST or
+     * STREAM_FROM_LATEST. Returns 1 if the group table is full or the name is too long. */
+    int i, free_slot = -1;
+    uint32_t expected;
+    assert(self);
+    assert(c);
+    c->stream = self;
+    c->group = -1;
+    c->skipped = 0;
+    c->offset = from == STREAM_FROM_LATEST ? __atomic_load_n(&self->hdr->next, __ATOMIC_ACQUIRE) : from;
+    if (group == NULL)
+        return 0;
+    if (strlen(group) >= STREAM_GROUP_NAME)
+        return 1;
+    for (;;) {
+        for (i = 0; i < STREAM_MAX_GROUPS; ++i) {
+            uint32_t state = __atomic_load_n(&self->groups[i].state, __ATOMIC_ACQUIRE);
+            while (state == GroupNaming)
+                state = __atomic_load_n(&self->groups[i].state, __ATOMIC_ACQUIRE);
+            if (state == GroupFree) {
+                if (free_slot < 0)
+                    free_slot = i;
+            } else if (strcmp(self->groups[i].name, group) == 0) {
+                c->group = i;
+                c->offset = __atomic_load_n(&self->groups[i].committed, __ATOMIC_ACQUIRE);
+                return 0;
+            }
+        }
+        if (free_slot < 0)
+            return 1;
+        expected = GroupFree;
+        if (__atomic_compare_exchange_n(&self->groups[free_slot].state, &expected, GroupNaming, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            strcpy(self->groups[free_slot].name, group);
+            self->groups[free_slot].committed = c->offset;
+            __atomic_store_n(&self->groups[free_slot].state, GroupActive, __ATOMIC_RELEASE);
+            c->group = free_slot;
+            return 0;
+        }
+        free_slot = -1;         /* lost the race for that slot: rescan, the winner may have created our group */
+    }
+}
+
+static inline void
+stream_commit(stream_consumer_t *c)
+{
+    /* records the consumer's position as its group's committed offset */
+    assert(c);
+    if (c->group >= 0)
+        __atomic_store_n(&c->stream->groups[c->group].committed, c->offset, __ATOMIC_RELEASE);
+}
+
+static inline void
+stream_seek(stream_consumer_t *c, uint64_t offset)
+{
+    /* replay from any offset; offsets older than the retained range continue from the oldest record */
+    assert(c);
+    c->offset = offset == STREAM_FROM_LATEST ? __atomic_load_n(&c->stream->hdr->next, __ATOMIC_ACQUIRE) : offset;
+}
+
+static inline uint64_t
+stream_lag(stream_consumer_t *c)
+{
+    uint64_t next = __atomic_load_n(&c->stream->hdr->next, __ATOMIC_ACQUIRE);
+    return next > c->offset ? next - c->offset : 0;
+}
+
+static inline int
+stream_valid(stream_t *self, const stream_record_t *rec)
+{
+    /* 1 while the bytes of a peeked record cannot have been reused by the producer */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&self->hdr->first, __ATOMIC_RELAXED) <= rec->offset;
+}
+
+static inline int
+stream_peek(stream_consumer_t *c, stream_record_t *rec)
+{
+    /* borrows the record at the consumer's offset without copying; returns 1 if there is none yet.
+     * Check stream_valid() after using rec->data, then stream_advance(). */
+    stream_t *s;
+    stream_index_t *e;
+    uint64_t first;
+    assert(c);
+    assert(rec);
+    s = c->stream;
+    for (;;) {
+        first = __atomic_load_n(&s->hdr->first, __ATOMIC_ACQUIRE);
+        if (c->offset < first) {
+            c->skipped += first - c->offset;
+            c->offset = first;
+        }
+        if (c->offset >= __atomic_load_n(&s->hdr->next, __ATOMIC_ACQUIRE))
+            return 1;
+        e = &s->index[c->offset & s->mask];
+        if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != c->offset + 1)
+            continue;           /* evicted and reused while we looked: re-read first */
+        rec->offset = c->offset;
+        rec->ts = e->ts;
+        rec->len = e->len;
+        rec->data = s->data + e->pos % s->hdr->capacity;
+        if (stream_valid(s, rec))
+            return 0;
+    }
+}
+
+static inline void
+stream_advance(stream_consumer_t *c)
+{
+    assert(c);
+    ++c->offset;
+}
+
+static inline int
+stream_wait(stream_consumer_t *c, uint64_t timeout_ns)
+{
+    /* returns 0 once a record at or after the consumer's offset exists, 1 on timeout */
+    stream_t *s = c->stream;
+    uint32_t seen;
+    for (;;) {
+        seen = __atomic_load_n(&s->hdr->notify, __ATOMIC_ACQUIRE);
+        if (c->offset < __atomic_load_n(&s->hdr->next, __ATOMIC_ACQUIRE))
+            return 0;
+        if (wait_for_change(&s->hdr->notify, seen, &s->hdr->waiters, &s->policy, timeout_ns) != 0)
+            return 1;
+    }
+}
+
+static inline int
+stream_read(stream_consumer_t *c, void *buf, size_t cap, size_t *len, uint64_t *offset, uint64_t timeout_ns)
+{
+    /* waits for, copies and consumes the next record; returns 1 on timeout or if it exceeds cap (not consumed) */
+    stream_record_t rec;
+    assert(buf);
+    assert(len);
+    for (;;) {
+        if (stream_peek(c, &rec) != 0) {
+            if (stream_wait(c, timeout_ns) != 0)
+                return 1;
+            continue;
+        }
+        *len = rec.len;
+        if (rec.len > cap)
+            return 1;
+        memcpy(buf, rec.data, rec.len);
+        if (!stream_valid(c->stream, &rec))
+            continue;           /* overwritten during the copy: stream_peek() moves on to `first` */
+        if (offset)
+            *offset = rec.offset;
+        stream_advance(c);
+        return 0;
+    }
+}
+
+#endif //P2PMD_SHM_STREAM_H
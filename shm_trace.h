@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ */
+
+#ifndef P2PMD_SHM_TRACE_H
+#define P2PMD_SHM_TRACE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "shm_segment.h"
+
+/***************************************************************************************************************\
+|*  Binary trace ring                                                                                          *|
+|***************************************************************************************************************|
+|*  Fixed-format 40-byte records (timestamp, event id, pid, two integer arguments) are written into a ring     *|
+|*  in a shared segment; nothing is formatted on the hot path. Any number of threads and processes may log     *|
+|*  into the same ring: a writer reserves a slot with one fetch_add on `head`, fills it and publishes it by    *|
+|*  storing `seq = position + 1` last. A reader (tools/trace_dump.c) trusts a slot only if its seq matches     *|
+|*  the position it expects, so records overwritten or half-written by a wrapped writer are skipped.           *|
+|*                                                                                                             *|
+|*  Tracing is compiled in only with -DSHM_ENABLE_TRACE; otherwise SHM_TRACE() expands to nothing. When        *|
+|*  compiled in but no ring was opened by the process, SHM_TRACE() costs one load and one branch.              *|
+\***************************************************************************************************************/
+
+#define TRACE_MAGIC 0x54524345u
+
+typedef enum _trace_event {
+    TraceNone = 0,
+    TraceRecvFailed = 1,
+    TraceSendFailed = 2,
+    TraceBadChunk = 3,
+    TraceChecksumMismatch = 4,
+    TracePeerDied = 5,
+    TraceUser = 1024
+} trace_event_t;
+
+typedef struct _trace_record {
+    volatile uint64_t seq;
+    uint64_t ts;
+    uint32_t event;
+    int32_t pid;
+    uint64_t arg[2];
+} trace_record_t;
+
+typedef struct _trace_header {
+    volatile uint32_t magic;
+    uint32_t entries;
+    char pad0[56];
+    volatile uint64_t head;
+    char pad1[56];
+} trace_header_t;
+
+typedef struct _trace_ring {
+    shared_segment_t segment;
+    trace_header_t *hdr;
+    trace_record_t *records;
+    uint64_t mask;
+} trace_ring_t;
+
+#ifdef SHM_ENABLE_TRACE
+/* process-wide ring used by SHM_TRACE(); weak so that every translation unit shares one definition */
+__attribute__((weak)) trace_ring_t *shm_trace_ring = NULL;
+#endif
+
+static inline const char *
+trace_event_name(uint32_t event)
+{
+    switch (event) {
+        case TraceRecvFailed:
+            return "recv_failed";
+        case TraceSendFailed:
+            return "send_failed";
+        case TraceBadChunk:
+            return "bad_chunk";
+        case TraceChecksumMismatch:
+            return "checksum_mismatch";
+        case TracePeerDied:
+            return "peer_died";
+        default:
+            return event >= TraceUser ? "user" : "unknown";
+    }
+}
+
+static inline int
+create_trace(trace_ring_t *self, const char *name, uint32_t entries)
+{
+    /* precondition: entries is a power of two */
+    size_t size;
+    assert(self);
+    assert(name);
+    assert(entries > 0 && (entries & (entries - 1)) == 0);
+    size = sizeof(trace_header_t) + sizeof(trace_record_t) * entries;
+    if (map_shared_segment(&self->segment, name, size) != 0)
+        return 1;
+    memset(self->segment.data, 0, size);
+    self->hdr = (trace_header_t *) self->segment.data;
+    self->hdr->entries = entries;
+    self->records = (trace_record_t *) (self->hdr + 1);
+    self->mask = entries - 1;
+    __atomic_store_n(&self->hdr->magic, TRACE_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static inline int
+open_trace(trace_ring_t *self, const char *name)
+{
+    assert(self);
+    assert(name);
+    if (attach_shared_segment(&self->segment, name) != 0)
+        return 1;
+    self->hdr = (trace_header_t *) self->segment.data;
+    if (__atomic_load_n(&self->hdr->magic, __ATOMIC_ACQUIRE) != TRACE_MAGIC
+        || sizeof(trace_header_t) + sizeof(trace_record_t) * (size_t) self->hdr->entries > self->segment.size) {
+        detach_shared_segment(&self->segment);
+        return 1;
+    }
+    self->records = (trace_record_t *) (self->hdr + 1);
+    self->mask = self->hdr->entries - 1;
+    return 0;
+}
+
+static inline void
+detach_trace(trace_ring_t *self)
+{
+    assert(self);
+#ifdef SHM_ENABLE_TRACE
+    if (shm_trace_ring == self)
+        shm_trace_ring = NULL;
+#endif
+    detach_shared_segment(&self->segment);
+}
+
+static inline void
+trace_install(trace_ring_t *self)
+{
+    /* makes SHM_TRACE() log into self, NULL to stop; does nothing unless built with -DSHM_ENABLE_TRACE */
+#ifdef SHM_ENABLE_TRACE
+    shm_trace_ring = self;
+#else
+    (void) self;
+#endif
+}
+
+static inline void
+trace_emit(trace_ring_t *self, uint32_t event, uint64_t a0, uint64_t a1)
+{
+    struct timespec ts;
+    uint64_t pos;
+    trace_record_t *r;
+    if (self == NULL)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    pos = __atomic_fetch_add(&self->hdr->head, 1, __ATOMIC_RELAXED);
+    r = &self->records[pos & self->mask];
+    __atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    r->ts = (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+    r->event = event;
+    r->pid = (int32_t) getpid();     /* not cached: a forked child logs its own pid */
+    r->arg[0] = a0;
+    r->arg[1] = a1;
+    __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static inline int
+trace_read(trace_ring_t *self, uint64_t pos, trace_record_t *out)
+{
+    /* copies the record at `pos`; returns 1 if it was overwritten, not yet published or torn */
+    trace_record_t *r = &self->records[pos & self->mask];
+    if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != pos + 1)
+        return 1;
+    out->ts = r->ts;
+    out->event = r->event;
+    out->pid = r->pid;
+    out->arg[0] = r->arg[0];
+    out->arg[1] = r->arg[1];
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) != pos + 1)
+        return 1;
+    out->seq = pos + 1;
+    return 0;
+}
+
+#ifdef SHM_ENABLE_TRACE
+#define SHM_TRACE(event, a0, a1) trace_emit(shm_trace_ring, (event), (uint64_t) (a0), (uint64_t) (a1))
+#else
+#define SHM_TRACE(event, a0, a1) ((void) 0)
+#endif
+
+#endif //P2PMD_SHM_TRACE_H
@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ */
+
+#ifndef P2PMD_SHM_WAIT_H
+#define P2PMD_SHM_WAIT_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <errno.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+/***************************************************************************************************************\
+|*  Adaptive waiting on a 32-bit word in shared memory                                                         *|
+|***************************************************************************************************************|
+|*  The waiter spins for a bounded number of iterations watching the word, then registers itself in a         *|
+|*  `waiters` counter that lives next to the word and goes to sleep on it (futex on Linux, a short            *|
+|*  nanosleep poll elsewhere). The publisher stores the new value, issues a full fence and only enters the     *|
+|*  kernel if `waiters` is non-zero. The fence pairs with the waiter's fence between incrementing `waiters`    *|
+|*  and re-checking the word, so either the publisher sees the waiter or the waiter sees the new value:        *|
+|*    waiter:     waiters++ ; fence ; if (word == old) sleep(word, old)                                        *|
+|*    publisher:  word = new ; fence ; if (waiters) wake(word)                                                 *|
+|*  The futex is never FUTEX_PRIVATE since the word is shared between processes.                               *|
+|*                                                                                                             *|
+|*  WaitUmwait replaces the PAUSE loop with UMONITOR on the word's cache line followed by UMWAIT in the light   *|
+|*  C0.1 state: the core idles (and yields its pipeline to the SMT sibling) until the publisher's store hits   *|
+|*  the monitored line or the TSC deadline passes. `spins` then counts UMWAIT rounds of WAIT_UMWAIT_CYCLES     *|
+|*  before falling back to the futex. Support (CPUID.7.0:ECX.WAITPKG) is probed at runtime; without it the     *|
+|*  mode degrades to the plain PAUSE loop of WaitAdaptive. cpu_pause_cycles() is the TPAUSE equivalent for     *|
+|*  callers that poll many words and so have nothing to monitor.                                               *|
+\***************************************************************************************************************/
+
+typedef enum _wait_mode {
+    WaitSpin = 1, WaitAdaptive = 2, WaitBlock = 3, WaitUmwait = 4
+} wait_mode_t;
+
+typedef struct _wait_policy {
+    wait_mode_t mode;
+    unsigned spins;
+} wait_policy_t;
+
+#define WAIT_DEFAULT_SPINS 4096
+#define WAIT_POLL_NS 50000
+#define WAIT_UMWAIT_CYCLES 20000
+#define WAIT_UMWAIT_ROUNDS 64
+
+static inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static inline int
+cpu_has_waitpkg(void)
+{
+    /* CPUID.(EAX=7,ECX=0):ECX[bit 5]; probed once per translation unit */
+#if defined(__x86_64__) || defined(__i386__)
+    static int waitpkg = -1;
+    unsigned a, b, c, d;
+    if (waitpkg < 0)
+        waitpkg = __get_cpuid_count(7, 0, &a, &b, &c, &d) && (c & (1u << 5)) ? 1 : 0;
+    return waitpkg;
+#else
+    return 0;
+#endif
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* emitted as raw bytes (register forms on rdi/edi) so that older assemblers accept them */
+static inline void
+cpu_umonitor(const volatile void *addr)
+{
+    __asm__ __volatile__(".byte 0xf3, 0x0f, 0xae, 0xf7" :: "D"(addr) : "memory");
+}
+
+static inline void
+cpu_umwait(uint64_t tsc_deadline)
+{
+    /* control 1 = C0.1: shallower state, faster wake-up */
+    __asm__ __volatile__(".byte 0xf2, 0x0f, 0xae, 0xf7"
+    :: "D"(1u), "a"((uint32_t) tsc_deadline), "d"((uint32_t) (tsc_deadline >> 32)) : "memory", "cc");
+}
+
+static inline void
+cpu_tpause(uint64_t tsc_deadline)
+{
+    __asm__ __volatile__(".byte 0x66, 0x0f, 0xae, 0xf7"
+    :: "D"(1u), "a"((uint32_t) tsc_deadline), "d"((uint32_t) (tsc_deadline >> 32)) : "memory", "cc");
+}
+#endif
+
+static inline void
+cpu_pause_cycles(uint64_t cycles)
+{
+    /* idle for roughly `cycles` TSC ticks: TPAUSE when available, a PAUSE loop otherwise */
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t end = __builtin_ia32_rdtsc() + cycles;
+    if (cpu_has_waitpkg()) {
+        cpu_tpause(end);
+        return;
+    }
+    while (__builtin_ia32_rdtsc() < end)
+        cpu_relax();
+#else
+    uint64_t i;
+    for (i = 0; i < cycles / 32; ++i)
+        cpu_relax();
+#endif
+}
+
+static inline uint64_t
+monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static inline int
+futex_wait_word(volatile uint32_t *word, uint32_t old, uint64_t timeout_ns)
+{
+    /* returns 0 when woken or the word changed, 1 on timeout; timeout_ns == 0 waits forever */
+#ifdef __linux__
+    struct timespec ts, *tsp = NULL;
+    if (timeout_ns != 0) {
+        ts.tv_sec = (time_t) (timeout_ns / 1000000000ull);
+        ts.tv_nsec = (long) (timeout_ns % 1000000000ull);
+        tsp = &ts;
+    }
+    if (syscall(SYS_futex, (uint32_t *) word, FUTEX_WAIT, old, tsp, NULL, 0) < 0 && errno == ETIMEDOUT)
+        return 1;
+    return 0;
+#else
+    uint64_t deadline = timeout_ns ? monotonic_ns() + timeout_ns : 0;
+    struct timespec ts = {0, WAIT_POLL_NS};
+    while (__atomic_load_n(word, __ATOMIC_ACQUIRE) == old) {
+        if (deadline && monotonic_ns() >= deadline)
+            return 1;
+        nanosleep(&ts, NULL);
+    }
+    return 0;
+#endif
+}
+
+static inline void
+futex_wake_word(volatile uint32_t *word, int count)
+{
+#ifdef __linux__
+    syscall(SYS_futex, (uint32_t *) word, FUTEX_WAKE, count, NULL, NULL, 0);
+#else
+    (void) word;
+    (void) count;
+#endif
+}
+
+static inline int
+wait_for_change(volatile uint32_t *word, uint32_t old, volatile uint32_t *waiters,
+                const wait_policy_t *policy, uint64_t timeout_ns)
+{
+    /* Precondition: *word was observed == old */
+    /* Postcondition: returns 0 once *word != old (acquire), 1 on timeout */
+    uint64_t deadline = 0;
+    unsigned spins = policy->mode == WaitBlock ? 0 : policy->spins;
+    unsigned i;
+    assert(word);
+    assert(waiters);
+    if (policy->mode == WaitUmwait && !cpu_has_waitpkg())
+        spins *= WAIT_DEFAULT_SPINS / WAIT_UMWAIT_ROUNDS;
+#if defined(__x86_64__) || defined(__i386__)
+    if (policy->mode == WaitUmwait && cpu_has_waitpkg()) {
+        for (i = 0; i < spins; ++i) {
+            if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != old)
+                return 0;
+            cpu_umonitor(word);
+            /* re-check after arming: a store between the load and UMONITOR would otherwise be missed */
+            if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != old)
+                return 0;
+            cpu_umwait(__builtin_ia32_rdtsc() + WAIT_UMWAIT_CYCLES);
+            if (timeout_ns != 0 && (i & 15) == 15) {
+                if (deadline == 0)
+                    deadline = monotonic_ns() + timeout_ns;
+                else if (monotonic_ns() >= deadline)
+                    return 1;
+            }
+        }
+        spins = 0;
+    }
+#endif
+    for (i = 0; i < spins || policy->mode == WaitSpin; ++i) {
+        if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != old)
+            return 0;
+        cpu_relax();
+        if (timeout_ns != 0 && (i & 1023) == 1023) {
+            if (deadline == 0)
+                deadline = monotonic_ns() + timeout_ns;
+            else if (monotonic_ns() >= deadline)
+                return 1;
+        }
+    }
+    if (timeout_ns != 0 && deadline == 0)
+        deadline = monotonic_ns() + timeout_ns;
+    __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(word, __ATOMIC_SEQ_CST) == old) {
+        uint64_t left = 0;
+        if (deadline != 0) {
+            uint64_t now = monotonic_ns();
+            if (now >= deadline) {
+                __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+                return 1;
+            }
+            left = deadline - now;
+        }
+        futex_wait_word(word, old, left);
+    }
+    __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return 0;
+}
+
+static inline void
+notify_change(volatile uint32_t *word, volatile uint32_t *waiters)
+{
+    /* Precondition: the new value of *word has already been stored with release semantics */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_RELAXED) != 0)
+        futex_wake_word(word, 0x7fffffff);
+}
+
+#endif //P2PMD_SHM_WAIT_H
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2018 Ruijie Fang.
+ * Open-sourced under the MIT License.
+ * Contact: rui.jie.fang [at] gmail.com
+ *
+ * Offline decoder for shm_trace.h rings.
+ *   cc -O2 -I.. -o trace_dump trace_dump.c
+ *   trace_dump /my_trace          decode a live ring by segment name
+ *   trace_dump -f saved.bin       decode a copy of the segment (e.g. cp /dev/shm/my_trace saved.bin)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../shm_trace.h"
+
+static int
+load_file(trace_ring_t *ring, const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    long size;
+    if (f == NULL)
+        return 1;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (size < (long) sizeof(trace_header_t)) {
+        fclose(f);
+        return 1;
+    }
+    ring->segment.fd = -1;
+    ring->segment.size = (size_t) size;
+    ring->segment.data = malloc((size_t) size);
+    if (ring->segment.data == NULL || fread(ring->segment.data, 1, (size_t) size, f) != (size_t) size) {
+        fclose(f);
+        return 1;
+    }
+    fclose(f);
+    ring->hdr = (trace_header_t *) ring->segment.data;
+    if (ring->hdr->magic != TRACE_MAGIC
+        || sizeof(trace_header_t) + sizeof(trace_record_t) * (size_t) ring->hdr->entries > (size_t) size)
+        return 1;
+    ring->records = (trace_record_t *) (ring->hdr + 1);
+    ring->mask = ring->hdr->entries - 1;
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    trace_ring_t ring;
+    trace_record_t rec;
+    uint64_t head, pos, lost = 0;
+    int from_file = argc == 3 && strcmp(argv[1], "-f") == 0;
+    if (argc != 2 && !from_file) {
+        fprintf(stderr, "usage: %s <segment name> | -f <segment copy>\n", argv[0]);
+        return 2;
+    }
+    if (from_file ? load_file(&ring, argv[2]) : open_trace(&ring, argv[1])) {
+        fprintf(stderr, "%s: not a trace ring\n", argv[argc - 1]);
+        return 1;
+    }
+    head = __atomic_load_n(&ring.hdr->head, __ATOMIC_ACQUIRE);
+    pos = head > ring.hdr->entries ? head - ring.hdr->entries : 0;
+    printf("# entries=%u head=%llu\n", ring.hdr->entries, (unsigned long long) head);
+    for (; pos < head; ++pos) {
+        if (trace_read(&ring, pos, &rec) != 0) {
+            ++lost;
+            continue;
+        }
+        printf("%llu.%09llu pid=%d %s(%u) %llu %llu\n",
+               (unsigned long long) (rec.ts / 1000000000ull), (unsigned long long) (rec.ts % 1000000000ull),
+               rec.pid, trace_event_name(rec.event), rec.event,
+               (unsigned long long) rec.arg[0], (unsigned long long) rec.arg[1]);
+    }
+    if (lost)
+        printf("# %llu records overwritten or in flight\n", (unsigned long long) lost);
+    return 0;
+}